@@ -0,0 +1,376 @@
+/* File: replay.c
+ * ---------------
+ * Host-side replay harness for sensor frames recorded on the Pi with
+ * `sonic_set_recording` (format in `sonic_rec.h`). Compiles the estimator in
+ * `object_vector.c` natively, feeds it the recorded frames in place of the
+ * sonic driver, and prints every prediction it makes, so the estimator can be
+ * tuned and benchmarked at host speed on real data. Recorded frames are raw,
+ * i.e. from before the driver's spike filter and background subtraction, so
+ * both are run here (from sonic_filter.c, as on the Pi) with whatever settings
+ * `object_vector_init` asks for. The recording doesn't hold the calibration
+ * readings the driver seeds the background with, so here it starts empty and
+ * is learned from the frames alone.
+ *
+ * Build with `make replay`. To record, set `RECORD_FRAMES` in main.c, then
+ * capture the raw serial stream on the host, e.g.
+ *     stty -F /dev/ttyUSB0 115200 raw && cat /dev/ttyUSB0 > throw.psr
+ * and run
+ *     ./replay [-v] [-c] [-n passes] throw.psr
+ * -v prints the position found from each individual frame; -n replays the
+ * whole recording that many times and reports the average time per frame.
+ * -c instead solves every frame for a position in both float and fixed point
+ * (see `FIXED_POINT` in object_vector.c) and reports how far apart the results
+ * are, and how long each takes over the -n passes.
+ * Built with REPLAYFLAGS=-DBALLISTIC=false, it also reports the mean of the
+ * accelerations the predictions were made with, for calibrating `gravity`.
+ */
+
+// Host headers come first: the Pi's utils.h defines `abs` etc. as macros
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/fixed.c"
+#include "../src/object_vector.c"
+#include "../src/sonic_filter.c"
+#include "sonic_rec.h"
+
+// ---------------- BEGIN SYSTEM LIBRARY STAND-INS ----------------
+// Functions from utils.h that the Pi's system library normally provides
+
+int round(float f)
+{
+    return f < 0 ? (int)(f - 0.5f) : (int)(f + 0.5f);
+}
+
+float sqrt(float f)
+{
+    return f < 0 ? -1 : __builtin_sqrtf(f);
+}
+// ---------------- END SYSTEM LIBRARY STAND-INS ----------------
+
+// ---------------- BEGIN SONIC DRIVER STAND-INS ----------------
+// Serves recorded frames to `object_vector.c` in place of the sensor array,
+// as if they arrived one per call to `object_vector_predict`. The array counts
+// as tracking until the recording runs out.
+static struct {
+    sonic_data_t (*frames)[N_SENSORS];
+    int n_frames;
+    int next;           // Index of next frame to hand out
+    int n_arrived;      // Frames the "sensor array" has completed so far
+    int filter_window;  // As passed to `sonic_set_filter`
+    unsigned filter_threshold;
+    bool background_on; // As passed to `sonic_set_background`
+    unsigned entry_range; // As passed to `sonic_set_idle_scan`
+    sonic_filter_t filters[N_SENSORS];
+    sonic_background_t backgrounds[N_SENSORS];
+    sonic_data_t frame[N_SENSORS]; // Last frame handed out, after filtering
+} replay;
+
+// Rewinds the recording and clears the spike filter and background history
+static void replay_rewind(void)
+{
+    replay.next = replay.n_arrived = 0;
+    memset(replay.filters, 0, sizeof(replay.filters));
+    for (int i = 0; i < N_SENSORS; i++) {
+        sonic_background_seed(&replay.backgrounds[i], SONIC_INVALID_READING, replay.frames[0][i].timestamp);
+    }
+}
+
+// What the driver would have reported for raw frame `f`. Skipped sensors read
+// like timeouts in a recording, so they are learned into the background here
+// where the driver would pass over them.
+static void process_frame(int f, sonic_data_t *frame)
+{
+    for (int i = 0; i < N_SENSORS; i++) {
+        frame[i] = replay.frames[f][i];
+        if (replay.filter_window && frame[i].distance != SONIC_INVALID_READING) {
+            frame[i].distance = sonic_filter_sample(&replay.filters[i], replay.filter_window,
+                replay.filter_threshold, frame[i].distance);
+        }
+    }
+    if (!replay.background_on) return;
+    for (int i = 0; i < N_SENSORS; i++) {
+        sonic_background_learn(&replay.backgrounds[i], replay.entry_range, frame[i].distance, frame[i].timestamp);
+        if (sonic_background_hides(&replay.backgrounds[i], frame[i].distance)) frame[i].distance = SONIC_INVALID_READING;
+    }
+}
+
+sonic_array_t *sonic_init(sonic_sensor_t sensors[], int n_sensors)
+{
+    return (sonic_array_t *)&replay;
+}
+
+bool sonic_set_schedule(sonic_array_t *arr, const unsigned groups[], int n_groups) { return true; }
+void sonic_set_range_gate(sonic_array_t *arr, unsigned max_speed) {}
+bool sonic_calibrate(sonic_array_t *arr) { return true; }
+
+bool sonic_set_filter(sonic_array_t *arr, int window, unsigned threshold)
+{
+    if (window < 0 || window == 1 || window == 2 || window > SONIC_FILTER_MAX_WINDOW) return false;
+    replay.filter_window = window;
+    replay.filter_threshold = threshold;
+    return true;
+}
+
+bool sonic_set_idle_scan(sonic_array_t *arr, const unsigned groups[], int n_groups, unsigned cycle_delay, unsigned entry_range)
+{
+    replay.entry_range = entry_range;
+    return true;
+}
+
+void sonic_set_background(sonic_array_t *arr, bool on)
+{
+    replay.background_on = on;
+}
+void sonic_on(sonic_array_t *arr) {}
+void sonic_set_recording(sonic_array_t *arr, bool on) {}
+void sonic_release(sonic_array_t *arr, sonic_data_t *frame) {}
+
+bool sonic_is_tracking(sonic_array_t *arr)
+{
+    return replay.next < replay.n_frames;
+}
+
+bool sonic_read_async(sonic_array_t *arr, sonic_data_t **read_dest)
+{
+    if (replay.next >= replay.n_arrived) return false;
+    process_frame(replay.next++, replay.frame);
+    *read_dest = replay.frame;
+    return true;
+}
+// ---------------- END SONIC DRIVER STAND-INS ----------------
+
+// ---------------- BEGIN DECODER ----------------
+// Undoes the CR that `uart_putchar` inserts before every LF. Returns new length.
+static size_t strip_inserted_cr(unsigned char *buf, size_t len)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\r' && i + 1 < len && buf[i + 1] == '\n') continue;
+        buf[out++] = buf[i];
+    }
+    return out;
+}
+
+// Reads one zigzag varint at `*pos`. Returns false if the data runs out first.
+static bool get_varint(const unsigned char *buf, size_t len, size_t *pos, int *value, unsigned char *checksum)
+{
+    unsigned zigzag = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*pos >= len) return false;
+        unsigned char byte = buf[(*pos)++];
+        *checksum += byte;
+        zigzag |= (unsigned)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes every intact frame after the first stream header in `buf`. Anything
+// before the header (e.g. console output) is skipped; decoding stops at the
+// first truncated or corrupt frame. Returns the number of frames decoded.
+static int decode(unsigned char *buf, size_t len)
+{
+    len = strip_inserted_cr(buf, len);
+    size_t magic_len = strlen(SONIC_REC_MAGIC);
+    size_t pos = 0;
+    while (pos + magic_len < len && memcmp(buf + pos, SONIC_REC_MAGIC, magic_len) != 0) pos++;
+    if (pos + magic_len >= len) {
+        fprintf(stderr, "No recording header found.\n");
+        return 0;
+    }
+    pos += magic_len;
+    int n_sensors = buf[pos++];
+    if (n_sensors != N_SENSORS) {
+        fprintf(stderr, "Recording has %d sensors per frame; estimator expects %d.\n", n_sensors, N_SENSORS);
+        return 0;
+    }
+
+    // No frame is shorter than 1 marker + 2 bytes per sensor + 1 checksum
+    replay.frames = malloc(sizeof(*replay.frames) * (len / (2 + 2 * N_SENSORS) + 1));
+    sonic_data_t prev[N_SENSORS] = {{0}};
+    int n_frames = 0;
+    while (pos < len) {
+        size_t start = pos;
+        unsigned char checksum = SONIC_REC_FRAME;
+        if (buf[pos++] != SONIC_REC_FRAME) break;
+        sonic_data_t *frame = replay.frames[n_frames];
+        bool ok = true;
+        for (int i = 0; i < N_SENSORS && ok; i++) {
+            int d_distance = 0, d_timestamp = 0;
+            ok = get_varint(buf, len, &pos, &d_distance, &checksum)
+                && get_varint(buf, len, &pos, &d_timestamp, &checksum);
+            frame[i].distance = prev[i].distance + d_distance;
+            frame[i].timestamp = (int)((unsigned)prev[i].timestamp + (unsigned)d_timestamp);
+        }
+        if (!ok || pos >= len || buf[pos++] != checksum) {
+            fprintf(stderr, "Recording ends with a damaged frame at byte %zu.\n", start);
+            break;
+        }
+        memcpy(prev, frame, sizeof(prev));
+        n_frames++;
+    }
+    return n_frames;
+}
+
+static unsigned char *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return NULL;
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *buf = malloc(*len);
+    *len = fread(buf, 1, *len, fp);
+    fclose(fp);
+    return buf;
+}
+// ---------------- END DECODER ----------------
+
+static void print_frame_positions(void)
+{
+    for (int f = 0; f < replay.n_frames; f++) {
+        int dists[N_SENSORS];
+        for (int i = 0; i < N_SENSORS; i++) {
+            dists[i] = replay.frames[f][i].distance;
+        }
+        vec_3d_t pos;
+        printf("Frame %d @ %u us: distances %d %d %d %d mm", f, (unsigned)replay.frames[f][0].timestamp,
+            dists[0], dists[1], dists[2], dists[3]);
+        if (pos_from_dists(dists, &pos)) printf(" -> position (%.0f, %.0f, %.0f) mm\n", pos.x, pos.y, pos.z);
+        else printf(" -> no position\n");
+    }
+}
+
+// ---------------- BEGIN FIXED-POINT COMPARISON ----------------
+static float distance_3d(vec_3d_t a, fix_vec_3d_t b)
+{
+    float dx = a.x - FIX_TO_FLOAT(b.x), dy = a.y - FIX_TO_FLOAT(b.y), dz = a.z - FIX_TO_FLOAT(b.z);
+    return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+static void compare(int n_passes)
+{
+    int n_solved = 0, n_mismatched = 0;
+    float error_sum = 0, error_max = 0;
+    for (int f = 0; f < replay.n_frames; f++) {
+        int dists[N_SENSORS];
+        for (int i = 0; i < N_SENSORS; i++) {
+            dists[i] = replay.frames[f][i].distance;
+        }
+        vec_3d_t pos;
+        fix_vec_3d_t fix_pos;
+        bool solved = pos_from_dists(dists, &pos);
+        if (solved != pos_from_dists_fixed(dists, &fix_pos)) n_mismatched++;
+        if (!solved) continue;
+        float error = distance_3d(pos, fix_pos);
+        error_sum += error;
+        error_max = error > error_max ? error : error_max;
+        n_solved++;
+    }
+    printf("Positions: %d solved, %d solved by only one estimator. Fixed is %.3f mm from float on average, %.3f mm at most.\n",
+        n_solved, n_mismatched, n_solved ? error_sum / n_solved : 0, error_max);
+
+    // NOTE: The host has an FPU, so this understates how much fixed point saves on the Pi
+    for (int fixed = 0; fixed <= 1; fixed++) {
+        clock_t start = clock();
+        for (int pass = 0; pass < n_passes; pass++) {
+            for (int f = 0; f < replay.n_frames; f++) {
+                int dists[N_SENSORS];
+                for (int i = 0; i < N_SENSORS; i++) {
+                    dists[i] = replay.frames[f][i].distance;
+                }
+                vec_3d_t pos;
+                fix_vec_3d_t fix_pos;
+                if (fixed) pos_from_dists_fixed(dists, &fix_pos);
+                else pos_from_dists(dists, &pos);
+            }
+        }
+        double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("%s positions: %.3f us per frame on this host.\n", fixed ? "Fixed" : "Float",
+            secs * 1e6 / ((double)n_passes * replay.n_frames));
+    }
+}
+// ---------------- END FIXED-POINT COMPARISON ----------------
+
+// Sum of the acceleration estimated at each prediction of the last printed run
+static vec_3d_t accel_sum;
+
+// Replays the whole recording once. Returns the number of predictions made.
+static int run(bool print)
+{
+    int n_predictions = 0;
+    replay_rewind();
+    while (replay.n_arrived < replay.n_frames) {
+        replay.n_arrived++;
+        prediction_t prediction;
+        if (!object_vector_predict(&prediction)) continue;
+        n_predictions++;
+        if (print) {
+            kinematic_t state = tracker_state(&tracker);
+            accel_sum.x += state.accel.x;
+            accel_sum.y += state.accel.y;
+            accel_sum.z += state.accel.z;
+            printf("Prediction after frame %d: board hit at (%.0f, %.0f) +/- %.0f mm from center in %u ms\n",
+                replay.next - 1, prediction.landing.x, prediction.landing.y, prediction.radius,
+                prediction.time_to_impact / 1000);
+        }
+    }
+    return n_predictions;
+}
+
+int main(int argc, char *argv[])
+{
+    bool verbose = false, compare_estimators = false;
+    int n_passes = 1;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-v") == 0) verbose = true;
+        else if (strcmp(argv[arg], "-c") == 0) compare_estimators = true;
+        else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) n_passes = atoi(argv[++arg]);
+        else break;
+    }
+    if (arg != argc - 1 || n_passes < 1) {
+        fprintf(stderr, "Usage: %s [-v] [-c] [-n passes] recording\n", argv[0]);
+        return 1;
+    }
+
+    size_t len;
+    unsigned char *buf = read_file(argv[arg], &len);
+    if (buf == NULL) {
+        fprintf(stderr, "Can't read %s.\n", argv[arg]);
+        return 1;
+    }
+    replay.n_frames = decode(buf, len);
+    free(buf);
+    printf("Decoded %d frames.\n", replay.n_frames);
+    if (replay.n_frames == 0) return 1;
+
+    object_vector_init(NULL);
+    if (verbose) print_frame_positions();
+    if (compare_estimators) {
+        compare(n_passes);
+        free(replay.frames);
+        return 0;
+    }
+    int n_predictions = run(true);
+    if (!BALLISTIC && n_predictions > 0) {
+        printf("Mean acceleration over the predictions: (%.0f, %.0f, %.0f) mm/s^2\n",
+            accel_sum.x / n_predictions, accel_sum.y / n_predictions, accel_sum.z / n_predictions);
+    }
+
+    clock_t start = clock();
+    for (int pass = 0; pass < n_passes; pass++) {
+        run(false);
+    }
+    double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%d predictions. %d passes in %.3f s (%.2f us per frame).\n",
+        n_predictions, n_passes, secs, secs * 1e6 / ((double)n_passes * replay.n_frames));
+    free(replay.frames);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+/*
+ * This module defines Q16.16 fixed-point numbers: a signed 32-bit integer
+ * holding a value times 2^16, so 16 bits of integer part (about +/-32767) and
+ * a resolution of about 0.000015. The Pi's ARM1176 is built without an FPU
+ * enabled, so every float operation is a libgcc call; a fixed-point multiply
+ * is a single 32x32->64 bit multiply and a shift.
+ *
+ * Nothing checks for overflow; callers pick units that keep their values in
+ * range.
+ */
+
+typedef int fix_t;
+
+#define FIX_FRAC_BITS 16
+#define FIX_ONE (1 << FIX_FRAC_BITS)
+
+#define FIX_TO_FLOAT(x)   ((float)(x) / FIX_ONE)
+
+/*
+ * Returns the square root of `n`, rounded down. Takes at most 32 steps of
+ * shifts and subtracts; no multiplies or divides.
+ */
+unsigned fix_isqrt64(unsigned long long n);
+
+#endif
@@ -31,6 +31,16 @@
  * to the main loop so the board can move there.
  */
 
+/*
+ * A prediction of where and when the object will hit the board.
+ */
+typedef struct {
+    board_pos_t landing;        // Where the object will cross the board's plane, in mm
+    float radius;               // RMS error of `landing`, in mm, as far as the estimator can tell
+    unsigned time_to_impact;    // Microsecs from `timestamp` until the object crosses the plane
+    unsigned timestamp;         // When the newest reading behind the prediction was taken (timer ticks)
+} prediction_t;
+
 /*
  * Initializes module and registers each element in the `sensors` array as
  * a distinct sonic sensor. Hard-coded to register exactly 4 elements of array
@@ -39,15 +49,33 @@
  */
 void object_vector_init(sonic_sensor_t sensors[]);
 
+/*
+ * Turns recording of the sensor array's raw frames over the UART on or off
+ * (see `sonic_set_recording`). Recordings can be replayed through this
+ * module's estimator on a host with `host/replay.c`.
+ */
+void object_vector_set_recording(bool on);
+
 /*
  * Main work function of module (and only public interface). Reads from the
  * ultrasonic sensor array, determines position of object in 3D space over time,
  * extrapolates the object's trajectory, and predicts where it will land on the
- * board, which is returned via parameter passing.
+ * board, which is returned via parameter passing along with how sure the
+ * estimate is and how long until impact.
+ *
+ * Never waits for the sensors: every reading that has arrived since the last
+ * call updates a running estimate of the object's trajectory, so calling this
+ * in a loop gives a fresh prediction after every reading. Early predictions
+ * rest on few readings and come with a wide `radius`; it shrinks as the track
+ * grows, so the caller can start moving on a rough guess and retarget later.
+ * No prediction is made until the track has 3 readings and follows them to
+ * within the sensors' noise; a track that keeps missing its readings is only
+ * used once it has waited out a full window of them.
  * 
  * Returns true if the object will contact the xy-plane at some point
- * in the future based on its current trajectory, false otherwise.
+ * in the future based on its current trajectory, false otherwise (including
+ * when there is no new reading, or not enough of one yet to tell).
  */
-bool object_vector_predict(board_pos_t *prediction);
+bool object_vector_predict(prediction_t *prediction);
 
 #endif
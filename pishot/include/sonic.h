@@ -17,19 +17,27 @@
  * added during initialization. The rationale for this design is that
  * multiple sonic sensors in proximity will interfere with one another
  * if they all emit signals simultaneously, so the array of nearby sensors
- * must be read element-wise in rapid succession.
+ * must be read element-wise in rapid succession. Sensors that are known
+ * not to interfere can instead be grouped and fired together
+ * (see `sonic_set_schedule`).
+ *
+ * Each independent set of sensors (e.g. one board) is a `sonic_array_t`,
+ * created by `sonic_init` and passed to every other function. Each array has
+ * its own schedule, delays, buffers and sensor statistics. Up to
+ * `SONIC_MAX_ARRAYS` arrays can be on at once; they share the module's single
+ * GPIO interrupt handler and armtimer.
  * 
  * IMPORTANT: This module utilizes the interrupts-based armtimer. The client
- * should not change the state of the armtimer at all while this module is
- * running (i.e. `sonic_on()` has been called).
+ * should not change the state of the armtimer at all while any array in this
+ * module is running (i.e. `sonic_on()` has been called).
  *
  * Written by Adam Shugar for PiShot in CS 107e, Winter 2020
  */
 typedef struct {
     int distance;  // In millimeters (accurate to +/-3mm); -1 if no object detected
-    int timestamp; // Pi timer reading halfway between trigger and echo
-                   // (theoretically this is the timestamp of the exact
-                   // moment the sound pulse reflected off the object).
+    int timestamp; // Pi timer reading halfway between rising and falling
+                   // edges of echo (theoretically this is the timestamp of
+                   // the exact moment the sound pulse reflected off the object).
                    // If no object detected, timestamp is set to timer
                    // reading immediately after trigger.
 } sonic_data_t;
@@ -39,67 +47,201 @@ typedef struct {
     unsigned echo;      // GPIO pin to read when pulse is received back
 } sonic_sensor_t;
 
-// Maximum number of simultaneous sonic sensors supported by this module
+// Maximum number of simultaneous sonic sensors supported per array
 #define SONIC_MAX_SENSORS 10
+// Maximum number of sensor arrays that can be initialized at once
+#define SONIC_MAX_ARRAYS 4
 // Minimum allowable delay between adjacent sensor readings, in microseconds
 #define SONIC_MIN_DELAY 1
 // Value for sensors that don't detect an object in range
 #define SONIC_INVALID_READING -1
+// Number of full-array frames preallocated for asynchronous mode. The read loop
+// only ever fills frames from this pool, so at most this many frames can be
+// queued or held by the client at once; cycles completed while the pool is
+// exhausted are dropped.
+#define SONIC_POOL_FRAMES 32
+
+typedef struct sonic_array sonic_array_t;
 
 /*
- * Initializes module and registers each element in the `sensors` array as
- * a distinct sonic sensor. Returns true if the initialization was successful,
- * false otherwise. Initialization fails if `n_sensors` exceeds the maximum allowed number.
+ * Creates a new sensor array and registers each element in the `sensors` array
+ * as a distinct sonic sensor in it. Returns a handle to the array if the
+ * initialization was successful, NULL otherwise. Initialization fails if
+ * `n_sensors` exceeds the maximum allowed number or `SONIC_MAX_ARRAYS` arrays
+ * already exist.
+ *
+ * All memory used by asynchronous mode (including the frame pool) is allocated
+ * here, so the interrupt-driven read loop never touches the heap.
  */
-bool sonic_init(sonic_sensor_t sensors[], size_t n_sensors);
+sonic_array_t *sonic_init(sonic_sensor_t sensors[], int n_sensors);
 
 /*
- * Returns the number of currently registered sensors. Guaranteed to be at least
+ * Returns the number of sensors registered in `arr`. Guaranteed to be at least
  * 0 and less than or equal to the maximum number of sensors supported.
  */
-int sonic_sensor_count(void);
+int sonic_sensor_count(sonic_array_t *arr);
+
+// Bit for sensor at index `i` (in registration order) in a firing group bitmask
+#define SONIC_SENSOR_BIT(i) (1u << (i))
+
+/*
+ * Sets the firing schedule used by both sync and async reads. Each element of
+ * `groups` is a bitmask (built with `SONIC_SENSOR_BIT`) of sensors that are
+ * triggered together; groups are fired in array order, and each sensor's echo
+ * is timed independently. Sensors whose beams don't overlap (e.g. diagonal
+ * corners) can share a group, cutting the worst-case cycle time from one
+ * timeout per sensor to one timeout per group. Grouped sensors can still hear
+ * each other's pings off a shared target: the farther one may then read
+ * (d_near + d_far) / 2, so groups trade accuracy for rate.
+ *
+ * Every registered sensor must appear in exactly one group. Returns true if
+ * the schedule was applied, false (no change) if it is invalid or async mode
+ * is on. Default schedule fires each sensor alone in registration order.
+ */
+bool sonic_set_schedule(sonic_array_t *arr, const unsigned groups[], int n_groups);
 
 /*
  * Instructs the module to insert a `micros` microsecond delay between each
- * sensor reading, including a between-cycle delay if current cycle delay less
+ * group reading, including a between-cycle delay if current cycle delay less
  * than the minimum allowable delay. Otherwise, cycle delay overrides between cycles.
+ * Discards any guard times found by `sonic_calibrate`.
  */
-void sonic_set_unit_delay(unsigned micros);
+void sonic_set_unit_delay(sonic_array_t *arr, unsigned micros);
 
 /*
  * Instructs the module to insert a `micros` microsecond delay between each reading
  * of the final sensor and the reading of the first sensor in the following cycle.
  * Default is same as minimum unit delay (`SONIC_MIN_DELAY`).
  */
-void sonic_set_cycle_delay(unsigned micros);
+void sonic_set_cycle_delay(sonic_array_t *arr, unsigned micros);
+
+/*
+ * Measures the shortest safe delay from each sensor finishing a reading to each
+ * sensor (itself included) being fired, and uses these guard times in place of
+ * the unit delay for both sync and async reads. A transition between two groups
+ * waits for the slowest pair of sensors involved; the delay between cycles is
+ * never shorter than the guard time either.
+ *
+ * Each sensor is first read alone after a long quiet period. Then, for every
+ * pair, the second sensor is fired at increasing delays after the first,
+ * starting from the unit delay, and the shortest delay at which its reading
+ * still matches the undisturbed one is kept. This catches both a sensor's own
+ * ring-down and its ping leaking into other sensors. Nothing in front of the
+ * array should move during calibration, which takes a few tenths of a second
+ * per pair of sensors in a quiet room and about a second at worst.
+ *
+ * Returns true if every pair found a guard time. A pair that never reads the
+ * same twice within the timeout keeps the unit delay as its guard time and
+ * makes this return false. Returns false (and does nothing) if async mode is on.
+ */
+bool sonic_calibrate(sonic_array_t *arr);
+
+/*
+ * Writes the calibrated guard time from sensor `from` finishing to sensor `to`
+ * firing to `micros`. Returns false if `arr` isn't calibrated or either index
+ * isn't a registered sensor.
+ */
+bool sonic_get_guard(sonic_array_t *arr, int from, int to, unsigned *micros);
 
 /*
  * Initiates continuous interrupts-based reading from all registered sensors.
- * Reading is done starting with first sensor registered and once the last
- * sensor is read, the cycle immediately starts again. If any sensor takes
+ * Reading is done starting with first group in the schedule and once the last
+ * group is read, the cycle immediately starts again. If any sensor takes
  * longer than the "timeout" number of microseconds to echo, it is skipped
  * on the current iteration and its distance reading is set to
  * `SONIC_INVALID_READING`.
  */
-void sonic_on(void);
+void sonic_on(sonic_array_t *arr);
 
 /*
  * Turns off continuous interrupts-based reading but does NOT clear buffer of
  * previous reads.
  */
-void sonic_off(void);
+void sonic_off(sonic_array_t *arr);
 
 /*
  * Returns true if module is on, i.e. currently reading data from sensor(s),
  * false otherwise.
  */
-bool sonic_is_active(void);
+bool sonic_is_active(sonic_array_t *arr);
+
+// Consecutive readings without even the start of an echo pulse after which a
+// sensor is considered dead and is taken out of the firing schedule
+#define SONIC_DEAD_STREAK 20
+// Microseconds between cycles that fire dead sensors anyway, to check whether they
+// have come back. Any echo from a dead sensor returns it to the schedule.
+#define SONIC_DEAD_PROBE_INTERVAL 100000
+
+typedef struct {
+    bool is_alive;           // False while sensor is excluded from the schedule
+    unsigned timeout_streak; // Number of consecutive readings with no echo pulse at all
+} sonic_health_t;
 
 /*
- * Frees up all memory and saved readings associated with this module and clears
- * the state. After calling this function it is as if the module were never init'ed.
+ * Writes the health of the sensor at index `sensor` (in registration order) to
+ * `health`. Returns true if `sensor` is a registered sensor, false otherwise.
+ *
+ * A dead sensor costs nothing per cycle: its reading is `SONIC_INVALID_READING`
+ * (timestamped when its group would have fired) except on the periodic probe
+ * cycles. A sensor with nothing in range still starts its echo pulse (it just
+ * never ends within the timeout), so it stays alive and keeps being fired.
  */
-void sonic_deinit(void);
+bool sonic_get_health(sonic_array_t *arr, int sensor, sonic_health_t *health);
+
+// Number of buckets in each sensor's echo time histogram
+#define SONIC_STATS_BUCKETS 8
+// Microseconds of echo time covered by each histogram bucket (~43 cm of range)
+#define SONIC_STATS_BUCKET_WIDTH 2500
+
+typedef struct {
+    unsigned n_fired;          // Times the sensor was triggered
+    unsigned n_echoes;         // Readings with an echo
+    unsigned n_timeouts;       // Readings that timed out
+    unsigned n_skipped;        // Readings left out (dead sensor, or outside the idle scan)
+    unsigned n_filtered;       // Echoes replaced by the spike filter
+    unsigned n_background;     // Echoes reported invalid for matching the background
+    unsigned readings_per_sec; // Echoes plus timeouts per second
+    unsigned timeout_percent;  // Share of readings that timed out
+    unsigned echo_histogram[SONIC_STATS_BUCKETS]; // Echo pulse widths, `SONIC_STATS_BUCKET_WIDTH`
+                               // microsecs per bucket; the last bucket also holds anything longer
+    unsigned interval_mean;    // Mean time between triggers, in microsecs
+    unsigned jitter_mean;      // Mean change in time between triggers from one to the next
+    unsigned jitter_max;       // Largest such change
+} sonic_sensor_stats_t;
+
+typedef struct {
+    unsigned elapsed;          // Microsecs since stats were last reset
+    unsigned n_frames;         // ASYNC ONLY: Frames completed
+    unsigned frames_per_sec;   // ASYNC ONLY: Frames completed per second
+    unsigned dropped_cycles;   // ASYNC ONLY: Oldest cycles dropped because the event log was full
+    unsigned pool_overruns;    // ASYNC ONLY: Frames lost because the client held every pool frame
+    unsigned latest_overruns;  // ASYNC ONLY: Frames never seen by `sonic_read_latest`
+    unsigned isr_count;        // ASYNC ONLY: Interrupts serviced for this array
+    unsigned isr_time_mean;    // ASYNC ONLY: Mean time spent per interrupt, in microsecs
+    unsigned isr_time_max;     // ASYNC ONLY: Longest time spent in one interrupt
+    sonic_sensor_stats_t sensors[SONIC_MAX_SENSORS]; // One entry per registered sensor
+} sonic_stats_t;
+
+/*
+ * Writes acquisition statistics for `arr` and each of its sensors, covering
+ * both sync and async reads since the last `sonic_reset_stats` (or
+ * `sonic_init`), to `stats`. Runs the bottom half first so that the figures
+ * are current. Every counter is updated in constant time as readings are
+ * made, so keeping them costs next to nothing.
+ */
+void sonic_get_stats(sonic_array_t *arr, sonic_stats_t *stats);
+
+/*
+ * Zeroes all of `arr`'s statistics and restarts the clock they are measured
+ * against. Other state (health, `sonic_latest_overruns`) is unaffected.
+ */
+void sonic_reset_stats(sonic_array_t *arr);
+
+/*
+ * Turns `arr` off and frees up all memory and saved readings associated with it.
+ * After calling this function the handle is invalid; other arrays are unaffected.
+ */
+void sonic_deinit(sonic_array_t *arr);
 
 // In microseconds; (3 m max dist) / (343 m / s sound in air) = 0.017492 s
 #define SONIC_DEFAULT_TIMEOUT 17492
@@ -110,28 +252,222 @@ void sonic_deinit(void);
  * reading obtained from testing the sensor. Takes effect starting with the next
  * sensor reading. Overrides the default timeout.
  */
-void sonic_set_timeout(unsigned micros);
+void sonic_set_timeout(sonic_array_t *arr, unsigned micros);
+
+// Fastest a ball is expected to move, in mm per millisecond (~15 ft/sec)
+#define SONIC_DEFAULT_TARGET_SPEED 5
+/*
+ * Enables range-gated timeouts for both sync and async reads. While a sensor
+ * is tracking a target, its listen window shrinks from the full timeout to the
+ * round-trip time for the target's previous distance plus however far an
+ * object moving at `max_speed` mm per millisecond could have travelled since;
+ * after a miss that sensor falls back to the full timeout. A group listens for
+ * as long as its longest window. Passing 0 disables gating (the default).
+ *
+ * NOTE: An HC-SR04 holds its echo pin high until its own echo arrives (about
+ * 38 ms if nothing reflects) and ignores triggers until then, so a sensor
+ * whose gate closes on a target that jumped out of it may still be busy when
+ * it is next fired. The end of that old pulse is recognized and discarded, so
+ * that reading simply times out (without counting against the sensor's
+ * health), and the fallback to the full window recovers from there. The same
+ * applies to a sensor with nothing in range that is re-fired within ~38 ms.
+ */
+void sonic_set_range_gate(sonic_array_t *arr, unsigned max_speed);
+
+// Consecutive full-schedule cycles without a target in range before the
+// rate controller drops back to the idle scan
+#define SONIC_TRACK_LOST_CYCLES 10
+/*
+ * Enables the asynchronous rate controller. While idle, each cycle fires only
+ * `groups` (which must be disjoint but need not cover every sensor), listens
+ * only long enough to hear an echo from within `entry_range` mm, and waits
+ * `cycle_delay` microseconds before the next cycle. Sensors outside `groups`
+ * read as `SONIC_INVALID_READING` in idle frames. As soon as any echo arrives
+ * from within `entry_range`, the array switches to tracking: the full schedule
+ * at the regular cycle delay (see `sonic_set_cycle_delay`). It returns to idle
+ * after `SONIC_TRACK_LOST_CYCLES` cycles in a row with no echo in range.
+ * Every `sonic_on` starts idle.
+ *
+ * Passing 0 for `n_groups` disables the controller so the full schedule always
+ * runs (the default). Returns false (changing nothing) if the array is active
+ * or `groups` is invalid.
+ */
+bool sonic_set_idle_scan(sonic_array_t *arr, const unsigned groups[], int n_groups, unsigned cycle_delay, unsigned entry_range);
+
+/*
+ * Returns true if `arr` is running its full schedule, i.e. a target is in range
+ * or the rate controller is disabled, false if it is idle-scanning.
+ */
+bool sonic_is_tracking(sonic_array_t *arr);
+
+/*
+ * Sets how old, in microseconds, a valid reading may be and still be kept when
+ * a synchronous read has to be redone for lack of valid sensors. With a nonzero
+ * age, a retry re-fires only the sensors without a fresh valid reading, so a
+ * returned frame can mix readings from several attempts (each sensor's
+ * timestamp tells when it was read). Passing 0 re-fires every sensor on every
+ * retry (the default).
+ */
+void sonic_set_retry_age(sonic_array_t *arr, unsigned micros);
+
+// Largest window `sonic_set_filter` accepts
+#define SONIC_FILTER_MAX_WINDOW 9
+// In mm; a reading this close to the median of its window is never a spike,
+// however steady the window (i.e. however small its spread) is
+#define SONIC_FILTER_MIN_DEVIATION 30
+/*
+ * Enables a streaming spike filter on every sensor's distances, in both sync
+ * and async reads. Each echo is compared with that sensor's last `window`
+ * echoes (including itself): if it is further from their median than
+ * `threshold` times their spread (median absolute deviation, scaled to
+ * estimate a standard deviation; 3 is a typical choice), it is reported as
+ * the median instead. Timeouts pass through untouched and aren't counted in
+ * the window. A genuine jump in distance passes once it makes up half the
+ * window, so a larger window rejects longer bursts of noise at the cost of
+ * reacting later.
+ *
+ * Passing 0 for `window` turns the filter off (the default). Any change clears
+ * the filter's history. Returns false (changing nothing) if `window` is 1, 2
+ * or larger than `SONIC_FILTER_MAX_WINDOW`.
+ */
+bool sonic_set_filter(sonic_array_t *arr, int window, unsigned threshold);
+
+// In mm; an echo must come from at least this much nearer than its sensor's
+// background to count as a target
+#define SONIC_BACKGROUND_MARGIN 250
+// In microsecs; how long a sensor must keep reading a new static distance (or
+// nothing at all) before that replaces its background
+#define SONIC_BACKGROUND_SETTLE 2000000
+/*
+ * Turns background subtraction on or off for async reads. Each sensor's
+ * background is the distance of the static scene in front of it (walls, the
+ * ceiling, the frame the board is mounted on), seeded from the readings taken
+ * by `sonic_calibrate` and then learned from every async frame: readings that
+ * match it refine it, and a different reading (or a run of timeouts) that
+ * holds still for `SONIC_BACKGROUND_SETTLE` replaces it. A moving target never
+ * holds still that long. Readings beyond the idle scan's entry range are
+ * treated as no background at all.
+ *
+ * While on, every echo that isn't at least `SONIC_BACKGROUND_MARGIN` nearer
+ * than its sensor's background is reported as `SONIC_INVALID_READING`, so a
+ * frame of nothing but background has no valid readings and is skipped by
+ * `sonic_read_burst`. Background echoes also stop counting as a target for the
+ * rate controller, so clutter within the entry range doesn't hold the array in
+ * tracking. Off by default.
+ */
+void sonic_set_background(sonic_array_t *arr, bool on);
+
+/*
+ * Writes `sensor`'s learned background distance in mm to `distance`
+ * (`SONIC_INVALID_READING` if it sees nothing static in range). Returns false
+ * (writing nothing) if background subtraction is off or `sensor` is invalid.
+ */
+bool sonic_get_background(sonic_array_t *arr, int sensor, int *distance);
+
+/*
+ * Turns recording on or off. While recording, every frame `arr` completes (in
+ * either sync or async mode) is written to the UART in the compact binary
+ * format described in `sonic_rec.h`, for replay on a host. Frames are recorded
+ * raw, as the sensors read them: before the spike filter (see `sonic_set_filter`)
+ * and background subtraction, so that both can be tuned on the recording.
+ * Turning recording on starts a new stream. The UART must be initialized and
+ * must not be used for anything else (e.g. `printf`) while recording, and the
+ * UART's bandwidth (about 11 KB/s) caps the frame rate that can be recorded.
+ */
+void sonic_set_recording(sonic_array_t *arr, bool on);
+
+/*
+ * Returns a bitmask (see `SONIC_SENSOR_BIT`) of the sensors in `frame` that
+ * hold a valid reading, i.e. not `SONIC_INVALID_READING`.
+ */
+unsigned sonic_valid_mask(sonic_array_t *arr, const sonic_data_t *frame);
 
 /*
- * Returns (by parameter passing) heap-allocated array of `readings` sensor array
- * readings, each with maximum `timeout_threshold` invalid readings. Returns true
- * if reading succeeded, otherwise (if async is currently on).
+ * Returns (by parameter passing) a heap-allocated sensor array reading with
+ * at least `min_valid` valid (i.e. not timed out) sensor readings; the array is
+ * re-read until this is satisfied (see `sonic_set_retry_age`). Returns true if
+ * reading succeeded, false otherwise (if async is currently on).
  *
  * It is the client's responsbility to free the resulting data once finished.
  */
-bool sonic_read_sync(sonic_data_t **read_dest, size_t readings, size_t timeout_threshold);
+bool sonic_read_sync(sonic_array_t *arr, sonic_data_t **read_dest, int min_valid);
 
 /*
- * Returns (by parameter passing) a dynamically-allocated array of distance
- * readings with one element for each registered sensor. It is the client's
- * responsibility to know the array size and to free this data once it is 
- * no longer needed. If there is no data to report, the parameter is unchanged.
+ * Performs `n_readings` back-to-back calls to `sonic_read_sync`, separated by
+ * the cycle delay, and stores each result in `read_dests`. Returns true if
+ * reading succeeded, false otherwise (if async is currently on).
+ *
+ * It is the client's responsbility to free each resulting reading once finished.
+ */
+bool sonic_read_sync_multiple(sonic_array_t *arr, sonic_data_t *read_dests[], int n_readings, int min_valid);
+
+/*
+ * Reads `n_frames` consecutive array readings, each with at least `min_valid`
+ * valid sensor readings, straight into caller-provided buffers without
+ * allocating anything. Both buffers are laid out as [n_frames][n_sensors]:
+ * the reading of sensor `s` in frame `f` is at index `f * sonic_sensor_count(arr) + s`
+ * of `distances` (in mm, or `SONIC_INVALID_READING`) and `timestamps`.
+ *
+ * If `arr` is off, the frames are read synchronously, separated by the cycle
+ * delay. If it is on, this blocks on the asynchronous FIFO instead, skipping
+ * frames with too few valid readings, and returns false if the rate controller
+ * drops back to idle before the burst is complete (see `sonic_set_idle_scan`).
+ * Returns true if all `n_frames` frames were written.
+ */
+bool sonic_read_burst(sonic_array_t *arr, int distances[], unsigned timestamps[], int n_frames, int min_valid);
+
+/*
+ * Runs the bottom half of asynchronous mode. The interrupt handlers only
+ * timestamp raw trigger/echo events into a log; this drains the log, converts
+ * the timings to distances, updates sensor health and range gates, and
+ * assembles and publishes complete frames. `sonic_read_async` and
+ * `sonic_read_latest` call it automatically, but a client that reads
+ * infrequently should call it regularly (from the main loop, or from a
+ * single soft-interrupt context) so the log never fills up. Once it does,
+ * the oldest cycles are dropped whole to make room for new ones, so a
+ * client that stalls loses the frames it missed but never current data.
+ * Must not be called from more than one context for the same array.
+ */
+void sonic_process(sonic_array_t *arr);
+
+/*
+ * Returns (by parameter passing) an array of distance readings with one
+ * element for each registered sensor. The array is a frame borrowed from
+ * `arr`'s preallocated pool: it is the client's responsibility to know
+ * the array size and to hand it back with `sonic_release` (NOT `free`) once it
+ * is no longer needed. If there is no data to report, the parameter is unchanged.
  * Assumes that the parameter is a valid memory address to write to.
  * Returns true if data was written, false otherwse.
 
  * NOTE: Does NOT trigger any gathering of new data from sensors;
  * only dequeues previously read data.
  */
-bool sonic_read_async(sonic_data_t **read_dest);
+bool sonic_read_async(sonic_array_t *arr, sonic_data_t **read_dest);
+
+/*
+ * Returns a frame obtained from `sonic_read_async` to `arr`'s pool so the read loop
+ * can refill it. The frame must not be accessed after it has been released.
+ */
+void sonic_release(sonic_array_t *arr, sonic_data_t *frame);
+
+/*
+ * Copies the most recently completed frame into `read_dest`, which must have
+ * room for one element per registered sensor. Unlike `sonic_read_async`, this
+ * skips straight past any older frames, so a client that falls behind always
+ * resumes on current data. The copy is guaranteed not to mix readings from two
+ * different frames. Returns true if a frame newer than the one returned by the
+ * previous call was available, false otherwise (in which case `read_dest` holds
+ * the same frame as last time, or garbage if no frame has completed yet).
+ *
+ * This channel is independent of the FIFO read by `sonic_read_async`; frames
+ * read here are still queued there and vice versa.
+ */
+bool sonic_read_latest(sonic_array_t *arr, sonic_data_t *read_dest);
+
+/*
+ * Returns the total number of completed frames that `sonic_read_latest` skipped
+ * over because a newer frame had already replaced them.
+ */
+unsigned sonic_latest_overruns(sonic_array_t *arr);
 
 #endif
@@ -0,0 +1,55 @@
+#ifndef SONIC_FILTER_H
+#define SONIC_FILTER_H
+
+#include <stdbool.h>
+#include "sonic.h"
+
+/*
+ * This module holds the per-sensor signal processing the sonic driver applies
+ * to raw distances: the spike filter behind `sonic_set_filter` and the
+ * background model behind `sonic_set_background`. Neither touches hardware or
+ * the array, so `host/replay.c` runs the same code over raw recordings.
+ */
+
+// Recent raw distances from one sensor, for the spike filter
+typedef struct {
+    int samples[SONIC_FILTER_MAX_WINDOW];   // Ring of the last `n` echoes
+    int n;                                  // Number of samples held, up to the filter window
+    int next;                               // Index in `samples` for the next echo
+} sonic_filter_t;
+
+// Learned static scene in front of one sensor
+typedef struct {
+    int distance;               // Background distance, or `SONIC_INVALID_READING` if nothing static is in range
+    int candidate;              // Most recent run of matching readings, which may be a change in the scene
+    unsigned candidate_since;   // Timestamp of the first reading in that run
+} sonic_background_t;
+
+/*
+ * Adds the echo `distance` to `filter` and returns the value to report for
+ * it: the distance itself, or the window median if it is a spike (see
+ * `sonic_set_filter` for `window_size` and `threshold`). `filter` must start
+ * zeroed.
+ */
+int sonic_filter_sample(sonic_filter_t *filter, int window_size, unsigned threshold, int distance);
+
+/*
+ * Resets `bg` to a background of `distance` (or none, for
+ * `SONIC_INVALID_READING`), as seen at timestamp `now`.
+ */
+void sonic_background_seed(sonic_background_t *bg, int distance, unsigned now);
+
+/*
+ * Updates `bg` with a reading of `distance` taken at `timestamp`. Readings
+ * beyond `entry_range` mm count as no background at all (0 for no limit).
+ * Returns true if the background distance changed.
+ */
+bool sonic_background_learn(sonic_background_t *bg, unsigned entry_range, int distance, unsigned timestamp);
+
+/*
+ * Returns true if an echo at `distance` isn't clearly in front of `bg`, i.e.
+ * should be reported as `SONIC_INVALID_READING`.
+ */
+bool sonic_background_hides(const sonic_background_t *bg, int distance);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef SONIC_LOG_H
+#define SONIC_LOG_H
+
+#include <stdbool.h>
+
+/*
+ * This module defines a ring buffer of raw sonic sensor events, used to pass
+ * echo timings from the GPIO/timer interrupt handlers (the "top half" of the
+ * sonic driver) to the code that turns them into distance frames (the
+ * "bottom half"). Events are stored by value, so recording one is a couple of
+ * word writes and never allocates.
+ *
+ * Like `sonic_rb`, the log allows concurrent access by 1 reader
+ * (sonic_log_dequeue) and 1 writer (sonic_log_enqueue) without locking.
+ * The exception is `sonic_log_drop_cycle`, which the writer uses to make room
+ * for new events: it moves the reader's end of the log, so the reader must
+ * keep the writer from running during each of its dequeues while the writer
+ * may drop cycles.
+ *
+ * Adapted from `sonic_rb`.
+ */
+
+enum sonic_event_kind {
+    SONIC_EVENT_TRIGGER = 0,    // Sensors in `sensors` were triggered at `timestamp`
+    SONIC_EVENT_RISE,           // Echo pins of sensors in `sensors` rose at `timestamp`
+    SONIC_EVENT_FALL,           // Echo pins of sensors in `sensors` fell at `timestamp`
+    SONIC_EVENT_TIMEOUT,        // Sensors in `sensors` did not echo before their window closed
+    SONIC_EVENT_SKIP,           // Sensors in `sensors` were left out of their group this cycle
+    SONIC_EVENT_BUSY,           // Sensors in `sensors` were still holding an earlier echo pulse when triggered
+    SONIC_EVENT_CYCLE_END,      // Every group in the schedule has been read
+};
+
+typedef struct {
+    unsigned short sensors;     // Bitmask of sensor indices the event applies to
+    unsigned char kind;         // One of `enum sonic_event_kind`
+    unsigned timestamp;         // Timer reading when the event was captured
+} sonic_event_t;
+
+typedef volatile struct sonic_log sonic_log_t;
+
+/*
+ * Initializes a new empty event log and returns a pointer to it, or NULL
+ * if the request cannot be satisfied.
+ */
+sonic_log_t *sonic_log_new(void);
+
+/*
+ * Returns true if `log` is currently empty, false otherwise.
+ */
+bool sonic_log_empty(sonic_log_t *log);
+
+/*
+ * Returns the number of events that can currently be enqueued to `log`
+ * before it is full.
+ */
+unsigned sonic_log_space(sonic_log_t *log);
+
+/*
+ * Adds `event` to the back of `log`. If the log is full, no changes are
+ * made and false is returned; otherwise returns true.
+ */
+bool sonic_log_enqueue(sonic_log_t *log, sonic_event_t event);
+
+/*
+ * Removes events from the front of `log` up to and including the first
+ * `SONIC_EVENT_CYCLE_END`, i.e. the rest of the oldest cycle. Returns false
+ * (and makes no change) if `log` holds no complete cycle.
+ */
+bool sonic_log_drop_cycle(sonic_log_t *log);
+
+/*
+ * If `log` is not empty, removes the frontmost event, stores it into
+ * *p_event, and returns true. Otherwise no changes are made to either the
+ * log or *p_event and the return value is false.
+ */
+bool sonic_log_dequeue(sonic_log_t *log, sonic_event_t *p_event);
+
+#endif
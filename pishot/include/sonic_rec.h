@@ -0,0 +1,49 @@
+#ifndef SONIC_REC_H
+#define SONIC_REC_H
+
+#include "sonic.h"
+
+/*
+ * This module encodes sonic frames into a compact binary stream and writes
+ * it out over the UART, so that real sensor data can be captured on a host
+ * and replayed there (see `host/replay.c`).
+ *
+ * Stream format:
+ *   header: the 4 bytes of `SONIC_REC_MAGIC`, then 1 byte holding the number
+ *           of sensors per frame
+ *   frame:  the byte `SONIC_REC_FRAME`, then for each sensor in order the
+ *           change in distance and the change in timestamp since that sensor's
+ *           reading in the previous frame (zero before the first frame), then
+ *           1 checksum byte: the sum of every byte of the frame before it,
+ *           `SONIC_REC_FRAME` included, modulo 256
+ * Each change is a signed integer, zigzag-mapped to unsigned (0, -1, 1, -2,
+ * ... become 0, 1, 2, 3, ...) and written 7 bits at a time, least significant
+ * first, with the top bit of every byte but the last set. A steadily tracked
+ * target costs a few bytes per sensor instead of 8.
+ *
+ * NOTE: `uart_putchar` sends CR before every LF byte. A reader must drop
+ * each CR byte (0x0D) that is immediately followed by an LF byte (0x0A);
+ * this undoes the insertion exactly.
+ */
+
+#define SONIC_REC_MAGIC "PSR1"
+#define SONIC_REC_FRAME 'F'
+
+typedef struct {
+    int n_sensors;
+    sonic_data_t prev[SONIC_MAX_SENSORS]; // Last frame written, base for the next one's changes
+} sonic_rec_t;
+
+/*
+ * Resets `rec` for a stream of `n_sensors`-sensor frames and writes the
+ * stream header.
+ */
+void sonic_rec_start(sonic_rec_t *rec, int n_sensors);
+
+/*
+ * Writes `frame` to the stream as changes from the previous frame written
+ * with `rec`. Blocks until the UART has accepted every byte.
+ */
+void sonic_rec_frame(sonic_rec_t *rec, const sonic_data_t frame[]);
+
+#endif
@@ -0,0 +1,24 @@
+/* File: fixed.c
+ * --------------
+ * Integer square root for Q16.16 fixed-point math.
+ */
+
+#include "fixed.h"
+
+unsigned fix_isqrt64(unsigned long long n)
+{
+    // Digit-by-digit method: settles one bit of the root per step, highest first
+    unsigned long long root = 0;
+    unsigned long long bit = 1ULL << 62;
+    while (bit > n) bit >>= 2;
+    while (bit) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (unsigned)root;
+}
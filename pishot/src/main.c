@@ -1,3 +1,4 @@
+#include "countdown.h"
 #include "gpio.h"
 #include "hoop.h"
 #include "interrupts.h"
@@ -6,6 +7,8 @@
 #include "printf.h"
 #include "sonic.h"
 #include "timer.h"
+#include "uart.h"
+#include "utils.h"
 
 /*
  * Written by Adam Shugar on March 11, 2020.
@@ -22,9 +25,17 @@
 
 // TODO: Update makefile for pishot and system library to -Ofast once development is finished
 
+// Set to true to stream every sensor frame over the UART for replay on a host (see host/replay.c)
+#define RECORD_FRAMES false
+
 #define N_MOTORS 4
 #define N_SENSORS 4
 
+// How sure a prediction has to be (see `prediction_t`) before the hoop starts
+// moving, and how far a surer one must move the target to send it again (mm)
+#define START_RADIUS 250
+#define RETARGET_DISTANCE 20
+
 typedef struct {
      motor_init_t motors[N_MOTORS];
      sonic_sensor_t sensors[N_SENSORS];
@@ -68,12 +79,31 @@ void main(void)
 {
      interrupts_init();
 
+     countdown_init(COUNTDOWN_MODE_CONTINUOUS, NULL);
      gpio_layout_t layout = get_pin_layout();
      hoop_init(layout.motors);
      object_vector_init(layout.sensors);
+     if (RECORD_FRAMES) {
+          uart_init();
+          object_vector_set_recording(true);
+     }
+     interrupts_global_enable(); // sensors scan in the background from here on
 
+     prediction_t target; // What the hoop was last sent to
+     bool committed = false;
      while (true) {
-          board_pos_t ball_hit;
-          if (object_vector_predict(&ball_hit)) hoop_move(ball_hit);
+          // Once the ball should have arrived, the next prediction is for a new throw
+          if (committed && timer_get_ticks() - target.timestamp > target.time_to_impact) committed = false;
+
+          prediction_t ball;
+          if (!object_vector_predict(&ball) || ball.radius > START_RADIUS) continue;
+          if (committed) {
+               // Hold unless the new guess is surer and moves the target noticeably
+               float moved = square(ball.landing.x - target.landing.x) + square(ball.landing.y - target.landing.y);
+               if (ball.radius >= target.radius || moved < square(RETARGET_DISTANCE)) continue;
+          }
+          hoop_move(ball.landing);
+          target = ball;
+          committed = true;
      }
 }
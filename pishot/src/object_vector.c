@@ -1,4 +1,4 @@
-#include "malloc.h"
+#include "fixed.h"
 #include "object_vector.h"
 #include "utils.h"
 
@@ -8,10 +8,32 @@
 
 #define N_SENSORS 4
 
-void object_vector_init(sonic_sensor_t sensors[])
-{
-    sonic_init(sensors, N_SENSORS);
-}
+// Whether positions are solved in Q16.16 fixed point (see fixed.h) instead of
+// float. The Pi is built soft-float, so every float operation is a library
+// call; `make replay` and `./replay -c` compare the two on a recording.
+#ifndef FIXED_POINT
+#define FIXED_POINT true
+#endif
+
+// How positions become a velocity and acceleration: a Kalman filter
+// (ESTIMATOR_KALMAN) or a least-squares quadratic over a sliding window of
+// positions (ESTIMATOR_WINDOW_FIT). Try the other one with
+// `make replay REPLAYFLAGS=-DESTIMATOR=ESTIMATOR_WINDOW_FIT`.
+#ifndef ESTIMATOR
+#define ESTIMATOR ESTIMATOR_KALMAN
+#endif
+
+// Whether the object is taken to be in free flight, accelerating at `gravity`,
+// so that the estimator only has to find its position and velocity
+#ifndef BALLISTIC
+#define BALLISTIC true
+#endif
+
+// Whether the diagonal pairs are fired together while tracking (see
+// `pair_schedule` for the bias this introduces). Off, each sensor fires alone.
+#ifndef CONCURRENT_FIRING
+#define CONCURRENT_FIRING false
+#endif
 
 /*
  * This module works as follows: first, get some number of valid
@@ -22,9 +44,9 @@ void object_vector_init(sonic_sensor_t sensors[])
  * to determine a 3D position vector R for the object/ball, with
  * respect to the plane of the board.
  * 
- * Do this multiple times in rapid succession over time intervals
- * of known length, and use the adjacent position vector values
- * to calculate a velocity and acceleration vector for the object.
+ * Do this for every reading as it arrives, and feed each position
+ * vector (with the time it was taken) into a tracker that keeps a
+ * running estimate of the object's position, velocity and acceleration.
  * Since we now have comprehensive 3D kinematic information for the
  * object, use this to predict where/whether the object will hit
  * the hoop board. At the top level of the module, send this
@@ -48,10 +70,28 @@ void object_vector_init(sonic_sensor_t sensors[])
  * Therefore, to make at least 5 guesses within 500 milliseconds, we
  * don't want to go above n = 7 for this module.
  *
- * We also don't need to worry about the noise introduced by the ball
- * moving during a single array reading (assuming n is reasonably small).
- * Max ball speed = 15 ft/sec = 4.5 m/s = 4.5 mm / ms = ~3 cm for one
- * 6 ms single-array reading.
+ * The ball does move during a single array reading, though: max ball
+ * speed = 15 ft/sec = 4.5 m/s = 4.5 mm / ms = ~3 cm for one 6 ms
+ * single-array reading. Treating the sensors of one reading as
+ * simultaneous skews every position by up to that much, and it takes
+ * extra readings to average the skew out. So before triangulating, each
+ * sensor's distance is interpolated (using the same sensor's reading in
+ * the neighbouring array reading) to one common timestamp per reading.
+ * With the skew gone, n = 5 gives the same accuracy n = 7 used to.
+ *
+ * Better still is not to start from nothing for every guess: a Kalman
+ * filter folds each new reading into the estimate it already has, at a
+ * fixed cost per reading, so a fresh guess is ready after every single
+ * reading (~6 ms) rather than after every n. How much history the
+ * estimate effectively rests on is now set by the tracker's noise
+ * settings rather than by n. The alternative least-squares fit keeps
+ * running sums over a window of the last few positions, which costs the
+ * same per reading and puts that history back under direct control: the
+ * window grows to n = 7 while the fit's residuals look like sensor noise,
+ * and sheds old positions as soon as they don't, so the tradeoff above is
+ * made per throw at runtime instead of once here. Either way, no guess is
+ * made from fewer than 3 readings, nor while the estimate's residuals are
+ * too large to be sensor noise, unless they stay that way for a full window.
  */
 
 // NOTE: All spatial quantities are in millimeters and all vels/accels are in mm/s(^2)
@@ -63,68 +103,72 @@ typedef struct {
 } vec_3d_t;
 
 
+// --------------- BEGIN TIME ALIGNMENT MODULE ---------------
+// Common timestamp for a whole array reading: average over its valid sensors
+static unsigned frame_timestamp(const int dists[], const unsigned times[])
+{
+    // Average offsets from first sensor rather than raw timestamps to avoid overflow
+    unsigned base = times[0];
+    int offset_sum = 0, n_valid = 0;
+    for (int i = 0; i < N_SENSORS; i++) {
+        if (dists[i] == SONIC_INVALID_READING) continue;
+        offset_sum += (int)(times[i] - base);
+        n_valid++;
+    }
+    return n_valid ? base + offset_sum / n_valid : base;
+}
+
+// Returns true and writes `sensor`'s distance at time `t` to `dist` by linear
+// interpolation (or extrapolation) between its readings in frames `a` and `b`.
+// Returns false if either reading is invalid or they share a timestamp.
+// Integer math throughout: a millimeter is below the sensors' accuracy anyway.
+static bool interpolate_dist(int dists[][N_SENSORS], unsigned times[][N_SENSORS], int a, int b, int sensor, unsigned t, int *dist)
+{
+    int dist_a = dists[a][sensor], dist_b = dists[b][sensor];
+    if (dist_a == SONIC_INVALID_READING || dist_b == SONIC_INVALID_READING) return false;
+    int dt_ab = (int)(times[b][sensor] - times[a][sensor]);
+    if (dt_ab == 0) return false;
+    int dt = (int)(t - times[a][sensor]);
+    *dist = dist_a + (int)((long long)(dist_b - dist_a) * dt / dt_ab);
+    return true;
+}
+
+// Resamples each of the `n_frames` consecutive array readings in `dists`/`times`
+// so that all its sensors read at one common timestamp, written to `timestamps`.
+// Each sensor is interpolated toward the neighbouring reading on the far side of
+// the common timestamp (falling back to the other neighbour, i.e. extrapolating);
+// a sensor with no usable neighbour keeps its raw distance. Invalid readings
+// stay invalid. Results go in `resampled`, which has the same shape as `dists`.
+static void resample_frames(int dists[][N_SENSORS], unsigned times[][N_SENSORS], int n_frames, int resampled[][N_SENSORS], unsigned timestamps[])
+{
+    for (int f = 0; f < n_frames; f++) {
+        unsigned t = frame_timestamp(dists[f], times[f]);
+        timestamps[f] = t;
+        for (int i = 0; i < N_SENSORS; i++) {
+            resampled[f][i] = dists[f][i];
+            if (dists[f][i] == SONIC_INVALID_READING) continue;
+
+            int next = f + 1 < n_frames ? f + 1 : -1;
+            int prev = f - 1;
+            // Prefer interpolating over extrapolating
+            bool read_early = (int)(times[f][i] - t) < 0;
+            int first = read_early ? next : prev;
+            int second = read_early ? prev : next;
+            int dist;
+            if ((first >= 0 && interpolate_dist(dists, times, f, first, i, t, &dist))
+                || (second >= 0 && interpolate_dist(dists, times, f, second, i, t, &dist))) {
+                resampled[f][i] = dist;
+            }
+        }
+    }
+}
+// --------------- END TIME ALIGNMENT MODULE ---------------
+
+
 // --------------- BEGIN 3D POSITION MODULE ---------------
 #define RECT_WIDTH 1219 // in mm
 #define RECT_HEIGHT 1219 // in mm
 
-typedef struct {
-    float displacement; // of center of circle from origin; whether displacement is for x or y
-                        // component is known by internal calling functions using this data type
-    float radius;
-} circle_t;
-
-#define NO_INTERSECTION -1
-// Function computing the circle (if any) created by the intersection of two spheres. This
-// is applied to the spheres of the sensor array to determine the object's (x, y) position.
-// `r_onzero`: the radius of the spheres w/ center on one or both coordinate axes (contrast with
-// `r_offzero`, the radius of the spheres w/ center on strictly fewer, i.e. zero or one, coordinate axes).
-// `centers_dist`: distance between center points of two spheres.
-// https://mathworld.wolfram.com/Sphere-SphereIntersection.html
-static circle_t xy_sphere_intersect(float r_offzero, float r_onzero, float centers_dist)
-{
-     float displacement, radius;
-     if (r_onzero + r_offzero >= centers_dist) { // Spheres intersect
-          // Formula for sphere intersection
-          displacement = (square(centers_dist) - square(r_offzero) + square(r_onzero)) / (2 * centers_dist);
-          radius = sqrt(square(r_onzero) - square(displacement));
-          if (radius < 0) { // One sphere completely encloses the other; set radius to -1 to signal no intersection
-               radius = -1;
-               displacement = 0;
-          }
-     } else { // Spheres don't intersect (too small); return halfway point between their closest bounds
-          displacement = ((centers_dist - r_offzero) + (r_onzero)) / 2;
-          radius = 0;
-     }
-     return (circle_t) { .displacement = displacement, .radius = radius };
-}
-
-// `offset_perpendic` is distance of center of circle away from center of sphere in direction perpendicular
-// to plane of sphere (similar meaning for `offset_parallel`).
-// Assumes sphere and circle are NOT concentric.
-static bool sphere_circle_hit(float r_sphere, float r_circle, float offset_perpedic, float offset_parallel)
-{
-    if (abs(offset_perpedic) > r_sphere) return false;
-    float parallel_dist = abs(offset_parallel);
-    // One edge of circle must be on one side (interior or exterior) of sphere, while other circle edge
-    // must be on other side of sphere
-    return (parallel_dist - r_circle < r_sphere) && (parallel_dist + r_circle > r_sphere);
-}
-
-// Similar to sphere intersection function, but all we care about is the z-coordinate
-// (depth) of the intersection point between the circle and sphere. We use this
-// geometry to compute the height of the object above the board.
-// Assumes sphere and circle are NOT concentric.
-// https://mathworld.wolfram.com/Circle-CircleIntersection.html
-static float z_circle_sphere_intersect(float r_sphere, float r_circle, float offset_perpendic, float offset_parallel)
-{
-    // First, find the circular cross-section within the sphere that the actual circle intersects.
-    float r_circ_intersec = r_sphere - offset_perpendic;
-    // Now just compute height of intersection of two circles, easy-peasy
-    float intersec_dist_xyplane = (square(offset_parallel) - square(r_circ_intersec) + square(r_circle)) / (2 * offset_parallel);
-    float z = sqrt(square(r_circle) - square(intersec_dist_xyplane));
-    return z < 0 ? NO_INTERSECTION : z;
-}
-
 // Determined by empirically testing sensors (HC-SR04 ultrasonics)
 #define MAX_SENSE_DEPTH 3000 // in mm
 enum {
@@ -134,178 +178,292 @@ enum {
     SENSOR_BOTTOM_LEFT,
 };
 
-// Returns true if valid position reading was found, false otherwise
-static bool pos_from_dists(sonic_data_t dists[], vec_3d_t *pos)
-{
-    // Set clear init value for debugging in case of function failure
-    *pos = (vec_3d_t) { .x = NO_INTERSECTION, .y = NO_INTERSECTION, .z = NO_INTERSECTION };
-
-    // First, ascertain x and y coordinates of object in plane of the board. Do this by conceptualizing
-    // each scalar ultrasonic reading as a "sphere" of possible object locations around the sensor,
-    // with radius equal to the distance read. Then find the intersections of these spheres,
-    // which will always be circles with plane perpendicular to the x or y axis connecting the sphere
-    // centers. The location of this circle along the connecting axis is the x or y coord we are
-    // trying to find.
-
-    circle_t left = xy_sphere_intersect(dists[SENSOR_TOP_LEFT].distance, dists[SENSOR_BOTTOM_LEFT].distance, RECT_HEIGHT);
-    circle_t right = xy_sphere_intersect(dists[SENSOR_TOP_RIGHT].distance, dists[SENSOR_BOTTOM_RIGHT].distance, RECT_HEIGHT);
-    circle_t top = xy_sphere_intersect(dists[SENSOR_TOP_RIGHT].distance, dists[SENSOR_TOP_LEFT].distance, RECT_WIDTH);
-    circle_t bottom = xy_sphere_intersect(dists[SENSOR_BOTTOM_RIGHT].distance, dists[SENSOR_BOTTOM_LEFT].distance, RECT_WIDTH);
-
-    // If both readings are valid, average for noise reduction
-    if (left.radius != NO_INTERSECTION && right.radius != NO_INTERSECTION) pos->y = (left.displacement + right.displacement) / 2;
-    else if (left.radius != NO_INTERSECTION) pos->y = left.displacement;
-    else if (right.radius != NO_INTERSECTION) pos->y = right.displacement;
-    // Both pairs of spheres don't intersect; can't ascertain y direction. Function fails.
-    else return false;
-
-    if (top.radius != NO_INTERSECTION && bottom.radius != NO_INTERSECTION) pos->x = (top.displacement + bottom.displacement) / 2;
-    else if (top.radius != NO_INTERSECTION) pos->x = top.displacement;
-    else if (bottom.radius != NO_INTERSECTION) pos->x = bottom.displacement;
-    // Both pairs of spheres don't intersect; can't ascertain x direction. Function fails.
-    else return false;
-
-    // Now, find the z coordinate of the object - its height above the board. This is done by
-    // looking at the intersection of the aforementioned spheres with the circles we just calculated
-    // (which themselves are intersections of two spheres). We look at the intersection of a given
-    // circle with either of the two spheres not involved in the circle's "creation" to find z.
-    // This is because intersection of a sphere with a skew circle in this fashion (assuming
-    // an intersection point exists) will give only 2 points, one of which is behind the board
-    // and we know our sensors cannot detect. So we choose the one with positive z.
-
-    // Traverse 4 out of 8 possible combinations of spheres and skew circles.
-    // If one is found, continue until a second is found so we can average the two
-    // resulting z values for greater accuracy.
-    bool found_z = false;
-    if (sphere_circle_hit(dists[SENSOR_TOP_LEFT].distance, right.radius, RECT_HEIGHT / 2, RECT_WIDTH)) {
-        pos->z = z_circle_sphere_intersect(dists[SENSOR_TOP_LEFT].distance, right.radius, RECT_HEIGHT / 2, RECT_WIDTH);
-        found_z = true;
-    }
-    if (sphere_circle_hit(dists[SENSOR_TOP_RIGHT].distance, bottom.radius, RECT_WIDTH / 2, RECT_HEIGHT)) {
-        float height = z_circle_sphere_intersect(dists[SENSOR_TOP_RIGHT].distance, bottom.radius, RECT_WIDTH / 2, RECT_HEIGHT);
-        if (found_z) { // Average both values and we're done
-            pos->z = (pos->z + height) / 2;
-            return true;
-        } else {
-            pos->z = height;
-            found_z = true;
+// Where each sensor sits on the board. Every sensor is in the plane of the
+// board (z = 0); nothing else in this module depends on the layout, so a
+// bigger array only needs more entries here (and a larger `N_SENSORS`).
+static const struct {
+    float x;
+    float y;
+} sensor_positions[N_SENSORS] = {
+    [SENSOR_TOP_LEFT] = { 0, RECT_HEIGHT },
+    [SENSOR_TOP_RIGHT] = { RECT_WIDTH, RECT_HEIGHT },
+    [SENSOR_BOTTOM_RIGHT] = { RECT_WIDTH, 0 },
+    [SENSOR_BOTTOM_LEFT] = { 0, 0 },
+};
+
+// Each sensor fired alone, so every echo is that sensor's own ping
+static const unsigned sequential_schedule[N_SENSORS] = {
+    SONIC_SENSOR_BIT(SENSOR_TOP_LEFT),
+    SONIC_SENSOR_BIT(SENSOR_TOP_RIGHT),
+    SONIC_SENSOR_BIT(SENSOR_BOTTOM_RIGHT),
+    SONIC_SENSOR_BIT(SENSOR_BOTTOM_LEFT),
+};
+
+// Diagonal corners are the farthest apart on the board, so firing each diagonal
+// pair together halves the number of timeouts a full array read can cost (2
+// instead of 4). Their beams don't overlap, but they do both reach the ball:
+// the nearer sensor's ping bounces off it and can land on the farther one
+// before that one's own echo, which then reads (d_near + d_far) / 2 instead of
+// d_far. A clear-board calibration can't rule this out since it only happens
+// off the object itself, so pairs are only used while tracking if
+// CONCURRENT_FIRING is set. The idle scan uses one pair regardless: it only
+// has to notice something in range, and a short reading is still a reading.
+static const unsigned pair_schedule[N_SENSORS / 2] = {
+    SONIC_SENSOR_BIT(SENSOR_TOP_LEFT) | SONIC_SENSOR_BIT(SENSOR_BOTTOM_RIGHT),
+    SONIC_SENSOR_BIT(SENSOR_TOP_RIGHT) | SONIC_SENSOR_BIT(SENSOR_BOTTOM_LEFT),
+};
+
+// Spike filter settings: 5 echoes rides out up to 2 bad readings in a row
+#define FILTER_WINDOW 5
+#define FILTER_THRESHOLD 3
+
+// While nothing is in range, one diagonal pair is enough to notice a ball
+// entering anywhere over the board, and it only needs checking a few times a second
+#define N_IDLE_GROUPS 1
+#define IDLE_CYCLE_DELAY 50000 // in microsecs
+
+// Gap between groups if calibration can't settle on guard times: a full
+// timeout, so any echo of one group's ping is back before the next group fires
+#define FALLBACK_UNIT_DELAY SONIC_DEFAULT_TIMEOUT // in microsecs
+
+/*
+ * Each scalar ultrasonic reading r_i is a "sphere" of possible object
+ * locations around sensor i at (x_i, y_i, 0):
+ *     (x - x_i)^2 + (y - y_i)^2 + z^2 = r_i^2
+ * Expanding the squares and substituting w = x^2 + y^2 + z^2 makes every
+ * sphere linear in (x, y, w):
+ *     -2 x_i x - 2 y_i y + w = r_i^2 - x_i^2 - y_i^2
+ * So any 3 or more spheres whose sensors aren't all in a line give (x, y, w)
+ * as the least squares solution P b, where b holds the right-hand sides and
+ * the pseudo-inverse P = (A^T A)^-1 A^T depends only on which sensors read
+ * validly. Then z = sqrt(w - x^2 - y^2), taking the root in front of the
+ * board since the sensors can't see behind it.
+ *
+ * P is precomputed for every subset of sensors at init, so a position costs a
+ * fixed 3 * N_SENSORS multiply-adds and one square root, whichever sensors are
+ * valid, and extra sensors beyond 3 average out reading noise for free.
+ */
+typedef struct {
+    bool solvable;              // Whether the subset has at least 3 sensors, not all in a line
+    float rows[3][N_SENSORS];   // P; columns of sensors outside the subset are all 0
+} pseudo_inverse_t;
+
+// Indexed by bitmask of valid sensors (see `SONIC_SENSOR_BIT`)
+static pseudo_inverse_t pseudo_inverses[1 << N_SENSORS];
+
+// Relative size below which A^T A's determinant counts as 0 (sensors in a line)
+#define SINGULAR_TOLERANCE 1e-4f
+
+// Inverts the symmetric 3x3 matrix `m` into `inverse`. Returns false if `m`
+// is too close to singular for the inverse to be trusted.
+static bool invert_symmetric(const float m[3][3], float inverse[3][3])
+{
+    // Cofactors; taking indices cyclically gives each cofactor its sign
+    float cof[3][3];
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            cof[r][c] = m[(r + 1) % 3][(c + 1) % 3] * m[(r + 2) % 3][(c + 2) % 3]
+                - m[(r + 1) % 3][(c + 2) % 3] * m[(r + 2) % 3][(c + 1) % 3];
         }
     }
-    if (sphere_circle_hit(dists[SENSOR_BOTTOM_RIGHT].distance, left.radius, RECT_HEIGHT / 2, RECT_WIDTH)) {
-        float height = z_circle_sphere_intersect(dists[SENSOR_BOTTOM_RIGHT].distance, left.radius, RECT_HEIGHT / 2, RECT_WIDTH);
-        if (found_z) {
-            pos->z = (pos->z + height) / 2;
-            return true;
-        } else {
-            pos->z = height;
-            found_z = true;
+    float det = m[0][0] * cof[0][0] + m[0][1] * cof[0][1] + m[0][2] * cof[0][2];
+    if (!(abs(det) > SINGULAR_TOLERANCE * m[0][0] * m[1][1] * m[2][2])) return false;
+
+    // `m` is symmetric, so its inverse is the cofactor matrix over the determinant
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) inverse[r][c] = cof[r][c] / det;
+    }
+    return true;
+}
+
+static void build_pseudo_inverse(unsigned valid, pseudo_inverse_t *pinv)
+{
+    // Row of A for each sensor
+    float a[N_SENSORS][3];
+    int n_valid = 0;
+    float ata[3][3] = {{0}};
+    for (int i = 0; i < N_SENSORS; i++) {
+        a[i][0] = -2 * sensor_positions[i].x;
+        a[i][1] = -2 * sensor_positions[i].y;
+        a[i][2] = 1;
+        if (!(valid & SONIC_SENSOR_BIT(i))) continue;
+        n_valid++;
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) ata[r][c] += a[i][r] * a[i][c];
         }
     }
-    if (sphere_circle_hit(dists[SENSOR_BOTTOM_LEFT].distance, top.radius, RECT_WIDTH / 2, RECT_HEIGHT)) {
-        float height = z_circle_sphere_intersect(dists[SENSOR_BOTTOM_LEFT].distance, top.radius, RECT_WIDTH / 2, RECT_HEIGHT);
-        if (found_z) {
-            pos->z = (pos->z + height) / 2;
-            return true;
-        } else {
-            pos->z = height;
-            found_z = true;
+
+    // A^+ = (A^T A)^-1 A^T, restricted to the valid sensors
+    float inverse[3][3];
+    pinv->solvable = invert_symmetric(ata, inverse) && n_valid >= 3;
+    for (int r = 0; r < 3; r++) {
+        for (int i = 0; i < N_SENSORS; i++) {
+            float sum = 0;
+            for (int c = 0; c < 3; c++) sum += inverse[r][c] * a[i][c];
+            pinv->rows[r][i] = (pinv->solvable && (valid & SONIC_SENSOR_BIT(i))) ? sum : 0;
         }
     }
+}
 
-    // If we only found one total height value we're also done
-    if (found_z) return true;
+static void build_pseudo_inverses(void)
+{
+    for (unsigned valid = 0; valid < (1 << N_SENSORS); valid++) {
+        build_pseudo_inverse(valid, &pseudo_inverses[valid]);
+    }
+}
 
-    // No z values were found from the method above, so we give our best guess for z.
-    // We never fail the function on under-determined z because we can approximate z fairly well.
+static unsigned valid_mask(const int dists[])
+{
+    unsigned valid = 0;
+    for (int i = 0; i < N_SENSORS; i++) {
+        if (dists[i] != SONIC_INVALID_READING) valid |= SONIC_SENSOR_BIT(i);
+    }
+    return valid;
+}
 
-    // Find minimum of all sphere intersection heights: object is at least this close in z
-    float z_guess = MAX_SENSE_DEPTH;
-    if (left.radius != NO_INTERSECTION) z_guess = min(left.radius, z_guess);
-    if (right.radius != NO_INTERSECTION) z_guess = min(right.radius, z_guess);
-    if (top.radius != NO_INTERSECTION) z_guess = min(top.radius, z_guess);
-    if (bottom.radius != NO_INTERSECTION) z_guess = min(bottom.radius, z_guess);
-    pos->z = z_guess;
+// Returns true if valid position reading was found, false otherwise
+static bool pos_from_dists(const int dists[], vec_3d_t *pos)
+{
+    const pseudo_inverse_t *pinv = &pseudo_inverses[valid_mask(dists)];
+    if (!pinv->solvable) return false;
 
+    float b[N_SENSORS];
+    for (int i = 0; i < N_SENSORS; i++) {
+        // Invalid sensors' entries meet zero columns of P, so they need no special case
+        b[i] = square((float)dists[i]) - square(sensor_positions[i].x) - square(sensor_positions[i].y);
+    }
+    float solution[3] = { 0, 0, 0 };
+    for (int r = 0; r < 3; r++) {
+        for (int i = 0; i < N_SENSORS; i++) solution[r] += pinv->rows[r][i] * b[i];
+    }
+    pos->x = solution[0];
+    pos->y = solution[1];
+    // Reading noise can put an object close to the board slightly behind it
+    float z_squared = solution[2] - square(pos->x) - square(pos->y);
+    pos->z = z_squared > 0 ? sqrt(z_squared) : 0;
     return true;
 }
 // --------------- END 3D POSITION MODULE ---------------
 
 
-// --------------- BEGIN HIT PREDICTION MODULE ---------------
-static inline vec_3d_t vec_add(vec_3d_t v1, vec_3d_t v2)
+// --------------- BEGIN FIXED-POINT POSITION MODULE ---------------
+// `pos_from_dists` in Q16.16 mm. The tracker below works in float either way:
+// its covariances span too many orders of magnitude for 16.16 bits.
+
+typedef struct {
+    fix_t x;
+    fix_t y;
+    fix_t z;
+} fix_vec_3d_t;
+
+// `pseudo_inverses` with every row scaled by its own power of 2 so its
+// largest entry fills 30 bits. The x and y rows hold entries of order 1e-4.
+typedef struct {
+    int rows[3][N_SENSORS];
+    int shifts[3];              // Entry = round(float entry * 2^shift)
+} fix_pseudo_inverse_t;
+
+static fix_pseudo_inverse_t fix_pseudo_inverses[1 << N_SENSORS];
+static int sensor_norms[N_SENSORS]; // x_i^2 + y_i^2 in mm^2
+
+static void build_fix_pseudo_inverses(void)
 {
-    return (vec_3d_t){ .x = v1.x + v2.x, .y = v1.y + v2.y, .z = v1.z + v2.z };
+    for (int i = 0; i < N_SENSORS; i++) {
+        sensor_norms[i] = square((int)sensor_positions[i].x) + square((int)sensor_positions[i].y);
+    }
+    for (unsigned valid = 0; valid < (1 << N_SENSORS); valid++) {
+        const pseudo_inverse_t *pinv = &pseudo_inverses[valid];
+        fix_pseudo_inverse_t *fix_pinv = &fix_pseudo_inverses[valid];
+        for (int r = 0; r < 3; r++) {
+            float largest = 0;
+            for (int i = 0; i < N_SENSORS; i++) largest = max(largest, abs(pinv->rows[r][i]));
+            // Results are shifted down by `shift - 16`, so never go below 16
+            int shift = FIX_FRAC_BITS;
+            float scale = FIX_ONE;
+            while (shift < 62 && largest * scale * 2 < (1 << 30)) {
+                shift++;
+                scale *= 2;
+            }
+            fix_pinv->shifts[r] = shift;
+            for (int i = 0; i < N_SENSORS; i++) fix_pinv->rows[r][i] = round(pinv->rows[r][i] * scale);
+        }
+    }
 }
 
-static inline vec_3d_t vec_sub(vec_3d_t pos_v, vec_3d_t neg_v)
+// Fixed-point `pos_from_dists`. The right-hand sides are exact integers in mm^2
+// and every product is accumulated in 64 bits, so the only rounding is in P.
+static bool pos_from_dists_fixed(const int dists[], fix_vec_3d_t *pos)
 {
-    return (vec_3d_t){ .x = pos_v.x - neg_v.x, .y = pos_v.y - neg_v.y, .z = pos_v.z - neg_v.z };
+    unsigned valid = valid_mask(dists);
+    if (!pseudo_inverses[valid].solvable) return false;
+    const fix_pseudo_inverse_t *pinv = &fix_pseudo_inverses[valid];
+
+    int b[N_SENSORS];
+    for (int i = 0; i < N_SENSORS; i++) {
+        b[i] = dists[i] * dists[i] - sensor_norms[i];
+    }
+
+    long long solution[3];
+    for (int r = 0; r < 3; r++) {
+        long long sum = 0;
+        for (int i = 0; i < N_SENSORS; i++) sum += (long long)pinv->rows[r][i] * b[i];
+        solution[r] = sum >> (pinv->shifts[r] - FIX_FRAC_BITS);
+    }
+    pos->x = (fix_t)solution[0];
+    pos->y = (fix_t)solution[1];
+    // w is far out of Q16.16 range (mm^2), so z^2 stays in 64 bits
+    long long z_squared = solution[2] - (((long long)pos->x * pos->x) >> FIX_FRAC_BITS)
+        - (((long long)pos->y * pos->y) >> FIX_FRAC_BITS);
+    pos->z = z_squared > 0 ? (fix_t)fix_isqrt64((unsigned long long)z_squared << FIX_FRAC_BITS) : 0;
+    return true;
 }
 
-static inline vec_3d_t vec_div(vec_3d_t v, float scalar)
+// Solves `dists` for a position in fixed or float, as `FIXED_POINT` selects
+static bool position_from_dists(const int dists[], vec_3d_t *pos)
 {
-    return (vec_3d_t){ .x = v.x / scalar, .y = v.y / scalar, .z = v.z / scalar };
+    if (!FIXED_POINT) return pos_from_dists(dists, pos);
+    fix_vec_3d_t fix_pos;
+    if (!pos_from_dists_fixed(dists, &fix_pos)) return false;
+    *pos = (vec_3d_t) { .x = FIX_TO_FLOAT(fix_pos.x), .y = FIX_TO_FLOAT(fix_pos.y), .z = FIX_TO_FLOAT(fix_pos.z) };
+    return true;
 }
+// --------------- END FIXED-POINT POSITION MODULE ---------------
+
 
+// --------------- BEGIN HIT PREDICTION MODULE ---------------
 typedef struct {
     vec_3d_t pos;
     vec_3d_t vel;
     vec_3d_t accel;
 } kinematic_t;
 
-// IMPORTANT: Assumes `n_positions` is at least 3 (needed to calc velocity and accel),
-// and assumes `positions` and `timestamps` arrays are of same length as `n_positions`.
-
-// The `timestamps` array contains a timestamp for each position reading, taken from
-// the middle sensor to fire (in a temporal sense) from the array.
-static kinematic_t trajec_from_positions(vec_3d_t positions[], unsigned timestamps[], int n_positions)
-{
-    // Velocity data will have length of position data - 1
-    // Accel data will have length of velocity data - 1
-    // (data for nth derivative of position will have length "posdatalen" - n;
-    // if n or fewer total pos data points then nth derivative is undefined)
-    int n_vels = n_positions - 1;
-    int n_accels = n_positions - 2;
-    vec_3d_t *vels = malloc(n_vels * sizeof(vec_3d_t));
-    vec_3d_t *accels = malloc(n_accels * sizeof(vec_3d_t));
+// Acceleration of a ball in free flight, in board coordinates (mm/s^2). The
+// board faces up, so z is height above it and gravity pulls along -z. If the
+// mount leans, replay a few clean throws with BALLISTIC off, average the
+// accelerations `./replay` reports, and build with them as GRAVITY_X/Y/Z.
+#ifndef GRAVITY_X
+#define GRAVITY_X 0
+#endif
+#ifndef GRAVITY_Y
+#define GRAVITY_Y 0
+#endif
+#ifndef GRAVITY_Z
+#define GRAVITY_Z -9807
+#endif
+static const vec_3d_t gravity = { .x = GRAVITY_X, .y = GRAVITY_Y, .z = GRAVITY_Z };
 
-    // Get timestamp of reading for init pos and final pos to determine dt
-    // and thus velocity: v = dr/dt ~= (r_final - r_init) / dt.
-    for (int i = 0; i < n_vels; i++) {
-        unsigned dt_micros = timestamps[i + 1] - timestamps[i];
-        vels[i] = vec_div(vec_sub(positions[i + 1], positions[i]), dt_micros);
-    }
+// How far, in mm/s^2 per axis, `gravity` may be off the board's true
+// acceleration: enough for a mount leaning about 10 degrees. BALLISTIC mode
+// still estimates acceleration within this much of `gravity`; build with 0
+// once `gravity` has been measured for the mount.
+#ifndef GRAVITY_UNCERTAINTY
+#define GRAVITY_UNCERTAINTY 2000.0f
+#endif
 
-    // Use "outside" timestamps of first and last of 3 points to calc accel
-    for (int i = 0; i < n_accels; i++) {
-        unsigned dt_micros = timestamps[i + 2] - timestamps[i];
-        accels[i] = vec_div(vec_sub(vels[i + 1], vels[i]), dt_micros);
-    }
-
-    // Average velocity and accel values for final result
-    vec_3d_t vels_avg = { .x = 0, .y = 0, .z = 0 };
-    for (int i = 0; i < n_vels; i++) {
-        vels_avg = vec_add(vels_avg, vels[i]);
-    }
-    vels_avg = vec_div(vels_avg, n_vels);
-
-    vec_3d_t accels_avg = { .x = 0, .y = 0, .z = 0 };
-    for (int i = 0; i < n_accels; i++) {
-        accels_avg = vec_add(accels_avg, accels[i]);
-    }
-    accels_avg = vec_div(accels_avg, n_accels);
-
-    free(vels);
-    free(accels);
-
-    // Use middle position reading for final result
-    return (kinematic_t) { .pos = positions[n_positions / 2], .vel = vels_avg, .accel = accels_avg };
-}
-
-// Result is returned by parameter passing (board_pos_t *); directly returns true if ANY
-// intersection with the xy-plane will happen in the future (even if it's outside
-// the bounds of the board), false otherwise
-static bool intersec_from_trajec(kinematic_t obj_trajec, board_pos_t *intersec)
+// Result is returned by parameter passing (board_pos_t *, and the time until it in secs);
+// directly returns true if ANY intersection with the xy-plane will happen in the future
+// (even if it's outside the bounds of the board), false otherwise
+static bool intersec_from_trajec(kinematic_t obj_trajec, board_pos_t *intersec, float *time)
 {
     // Get time until object hits board (t when z(t) == 0)
     float v_z = obj_trajec.vel.z;
@@ -318,16 +476,18 @@ static bool intersec_from_trajec(kinematic_t obj_trajec, board_pos_t *intersec)
         // Takes advantage of fact that in any coordinate system, orthogonal components
         // are independent (x(t), y(t) can be computed independent of z(t)'s value)
         // (We assume constant acceleration when predicting)
-        float t1 = (-v_z + sqrt(v_z * v_z - 2 * a_z *z)) / a_z;
-        float t2 = (-v_z - sqrt(v_z * v_z - 2 * a_z *z)) / a_z;
-        // Constrain times to positive (i.e. in the future); we don't care if object would have
+        // Roots in the form -2z / (v_z +- sqrt(...)), which stays finite as a_z goes to 0
+        float root = sqrt(v_z * v_z - 2 * a_z *z);
+        float t1 = v_z + root != 0 ? -2 * z / (v_z + root) : -1;
+        float t2 = v_z - root != 0 ? -2 * z / (v_z - root) : -1;
+        // Only times in the future count; we don't care if object would have
         // hit the board in the past w/ its current trajectory
-        t1 = max(0, t1);
-        t2 = max(0, t2);
-        float time_earlier = min(t1, t2);
+        if (t1 < 0 && t2 < 0) return false;
+        float time_earlier = t1 < 0 ? t2 : t2 < 0 ? t1 : min(t1, t2);
         // Kinematics equations
         board.x = obj_trajec.pos.x + obj_trajec.vel.x * time_earlier + 0.5 * obj_trajec.accel.x * square(time_earlier);
         board.y = obj_trajec.pos.y + obj_trajec.vel.y * time_earlier + 0.5 * obj_trajec.accel.y * square(time_earlier);
+        *time = time_earlier;
     } else {
         board.x = board.y = 0;
         return false;
@@ -335,51 +495,589 @@ static bool intersec_from_trajec(kinematic_t obj_trajec, board_pos_t *intersec)
     *intersec = board;
     return true;
 }
+
+// RMS distance between the intersection `time` secs ahead of `obj_trajec` and where
+// the object will really hit, given the covariance `cov` of each axis's position,
+// velocity and acceleration. Linearized: x and y errors carry straight through the
+// kinematics, while a z error shifts the time of impact by -dz / v_z, which moves
+// the intersection along the object's velocity at impact.
+static float intersec_spread(kinematic_t obj_trajec, const float cov[3][3][3], float time)
+{
+    const float j[3] = { 1, time, time * time / 2 };
+    float var[3];
+    for (int a = 0; a < 3; a++) {
+        var[a] = 0;
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) var[a] += j[r] * cov[a][r][c] * j[c];
+        }
+    }
+    float v_x = obj_trajec.vel.x + obj_trajec.accel.x * time;
+    float v_y = obj_trajec.vel.y + obj_trajec.accel.y * time;
+    float v_z = obj_trajec.vel.z + obj_trajec.accel.z * time;  // Nonzero at a real intersection
+    float time_var = var[2] / square(v_z);
+    return sqrt(var[0] + var[1] + (square(v_x) + square(v_y)) * time_var);
+}
 // --------------- END HIT PREDICTION MODULE ---------------
 
 
+// --------------- BEGIN WINDOW FIT MODULE ---------------
+// Least-squares quadratic p(t) = c0 + c1 t + c2 t^2 per axis over the last
+// few positions. The normal equations only need sums of powers of t and of
+// p times powers of t, so those are kept as running sums: a position entering
+// or leaving the window costs one add or subtract per sum.
+// How many positions the window keeps follows the residuals: while the fit
+// explains its positions to within the sensors' noise, the window grows to
+// `FIT_MAX_WINDOW` to average the noise down; once it stops explaining them
+// (drag, spin, a bounce, a new object) it sheds the history that no longer
+// fits, down to `FIT_MIN_WINDOW`.
+
+// Coefficients fitted per axis; BALLISTIC fixes c2 by gravity
+#define FIT_PARAMS (BALLISTIC ? 2 : 3)
+// Most positions in a fit: about 40 ms of flight (see the NOTE up top)
+#ifndef FIT_MAX_WINDOW
+#define FIT_MAX_WINDOW 7
+#endif
+// Fewest positions in a fit: at least 3, and enough to leave one residual to go by
+#define FIT_MIN_WINDOW max(3, FIT_PARAMS + 1)
+// Worst per-axis RMS residual, in mm, over which the fit no longer follows the
+// object: about three times the spread of a single position
+#define FIT_RESIDUAL_THRESHOLD 30.0f
+// Fit time unit, in microsecs: close to the window's span, so the powers of t
+// stay near 1 and the normal equations stay well conditioned in float
+#define FIT_TIME_UNIT 50000
+
+typedef struct {
+    unsigned times[FIT_MAX_WINDOW]; // Ring of the positions in the window
+    vec_3d_t positions[FIT_MAX_WINDOW];
+    int n;                          // Positions in the window
+    int limit;                      // Most positions to keep, set by `window_adapt`
+    int oldest;                     // Ring index of the oldest position
+    int n_since_rebase;             // Positions added since the sums were rebuilt
+    unsigned t0;                    // Origin of t in the sums
+    vec_3d_t p0;                    // Origin of p in the sums
+    float t_sums[5];                // Sum of t^k, k = 0..4
+    float p_sums[3][3];             // Per axis, sum of p t^k, k = 0..2
+    float p_squares[3];             // Per axis, sum of p^2
+} window_fit_t;
+
+typedef struct {
+    float coeffs[3][3];     // Per axis c0, c1, c2; t is in fit units since `t0`, p is in mm from `p0`
+    float residuals[3];     // Per axis RMS distance of the positions from the fit, in mm
+    float inverse[3][3];    // Of the normal equations: the coefficients' covariance over a position's variance
+} fit_result_t;
+
+// Adds (`sign` = 1) or removes (`sign` = -1) one position's terms in the sums
+static void window_accumulate(window_fit_t *w, unsigned timestamp, vec_3d_t pos, float sign)
+{
+    float t = (float)(int)(timestamp - w->t0) / FIT_TIME_UNIT;
+    float p[3] = { pos.x - w->p0.x, pos.y - w->p0.y, pos.z - w->p0.z };
+    float t_pow = sign;
+    for (int k = 0; k < 5; k++) {
+        w->t_sums[k] += t_pow;
+        if (k < 3) {
+            for (int a = 0; a < 3; a++) w->p_sums[a][k] += p[a] * t_pow;
+        }
+        t_pow *= t;
+    }
+    for (int a = 0; a < 3; a++) w->p_squares[a] += sign * p[a] * p[a];
+}
+
+// Rebuilds the sums from the ring about the oldest position. Subtracting
+// leaves float rounding behind, so this runs once per `FIT_MAX_WINDOW` positions,
+// which keeps the cost per position constant and t and p small.
+static void window_rebase(window_fit_t *w)
+{
+    w->t0 = w->times[w->oldest];
+    w->p0 = w->positions[w->oldest];
+    for (int k = 0; k < 5; k++) w->t_sums[k] = 0;
+    for (int a = 0; a < 3; a++) {
+        for (int k = 0; k < 3; k++) w->p_sums[a][k] = 0;
+        w->p_squares[a] = 0;
+    }
+    for (int i = 0; i < w->n; i++) {
+        int slot = (w->oldest + i) % FIT_MAX_WINDOW;
+        window_accumulate(w, w->times[slot], w->positions[slot], 1);
+    }
+    w->n_since_rebase = 0;
+}
+
+static void window_reset(window_fit_t *w)
+{
+    w->n = 0;
+    w->oldest = 0;
+    w->limit = FIT_MAX_WINDOW;
+}
+
+// Adds a position to the window, first pushing out the oldest ones so it
+// keeps no more than `limit`
+static void window_add(window_fit_t *w, unsigned timestamp, vec_3d_t pos)
+{
+    while (w->n >= w->limit) {
+        window_accumulate(w, w->times[w->oldest], w->positions[w->oldest], -1);
+        w->oldest = (w->oldest + 1) % FIT_MAX_WINDOW;
+        w->n--;
+    }
+    int slot = (w->oldest + w->n) % FIT_MAX_WINDOW;
+    w->times[slot] = timestamp;
+    w->positions[slot] = pos;
+    w->n++;
+    if (w->n == 1 || ++w->n_since_rebase >= FIT_MAX_WINDOW) {
+        window_rebase(w);
+    } else {
+        window_accumulate(w, timestamp, pos, 1);
+    }
+}
+
+// Solves the normal equations of the window. Returns false if there are fewer
+// positions than coefficients or their times are too bunched up to fix them.
+static bool window_solve(const window_fit_t *w, fit_result_t *fit)
+{
+    if (w->n < FIT_PARAMS) return false;
+    // With c2 fixed, the unused row and column are the identity's and solve to 0
+    float m[3][3], inverse[3][3];
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) m[r][c] = (r < FIT_PARAMS && c < FIT_PARAMS) ? w->t_sums[r + c] : r == c;
+    }
+    if (!invert_symmetric(m, inverse)) return false;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) fit->inverse[r][c] = (r < FIT_PARAMS && c < FIT_PARAMS) ? inverse[r][c] : 0;
+    }
+
+    const float unit = FIT_TIME_UNIT / 1e6f;  // in secs
+    const float g[3] = { gravity.x, gravity.y, gravity.z };
+    for (int a = 0; a < 3; a++) {
+        // BALLISTIC fits c0 + c1 t to q = p - c2 t^2, whose sums follow from those of p
+        float c2 = BALLISTIC ? g[a] / 2 * unit * unit : 0;
+        float q_squares = w->p_squares[a] - 2 * c2 * w->p_sums[a][2] + c2 * c2 * w->t_sums[4];
+        float b[3];
+        for (int k = 0; k < 3; k++) b[k] = k < FIT_PARAMS ? w->p_sums[a][k] - c2 * w->t_sums[k + 2] : 0;
+
+        float fitted = 0;
+        for (int r = 0; r < 3; r++) {
+            fit->coeffs[a][r] = 0;
+            for (int c = 0; c < 3; c++) fit->coeffs[a][r] += inverse[r][c] * b[c];
+            fitted += fit->coeffs[a][r] * b[r];
+        }
+        fit->coeffs[a][2] += c2;
+        // Sum of squared residuals is sum q^2 - c . (sum q t^k) when c solves the normal equations
+        float sse = max(q_squares - fitted, 0);
+        fit->residuals[a] = w->n > FIT_PARAMS ? sqrt(sse / (w->n - FIT_PARAMS)) : 0;
+    }
+    return true;
+}
+
+// Sizes the window for the next position from how well `fit` follows this
+// one's: a position longer while every axis is within `FIT_RESIDUAL_THRESHOLD`,
+// half as long as now while one is not
+static void window_adapt(window_fit_t *w, const fit_result_t *fit)
+{
+    if (w->n <= FIT_PARAMS) return;  // Residuals are all 0 until then
+    float residual = max(fit->residuals[0], max(fit->residuals[1], fit->residuals[2]));
+    if (residual > FIT_RESIDUAL_THRESHOLD) {
+        w->limit = max(w->n / 2, FIT_MIN_WINDOW);
+    } else {
+        w->limit = min(w->limit + 1, FIT_MAX_WINDOW);
+    }
+}
+
+// Time of the newest position in the window, in fit units
+static float window_newest(const window_fit_t *w)
+{
+    unsigned newest = w->times[(w->oldest + w->n - 1) % FIT_MAX_WINDOW];
+    return (float)(int)(newest - w->t0) / FIT_TIME_UNIT;
+}
+
+// Motion at the newest position in the window according to `fit`
+static kinematic_t window_state(const window_fit_t *w, const fit_result_t *fit)
+{
+    const float unit = FIT_TIME_UNIT / 1e6f;  // in secs
+    float t = window_newest(w);
+    float pos[3], vel[3], accel[3];
+    float origin[3] = { w->p0.x, w->p0.y, w->p0.z };
+    for (int a = 0; a < 3; a++) {
+        const float *c = fit->coeffs[a];
+        pos[a] = origin[a] + c[0] + (c[1] + c[2] * t) * t;
+        vel[a] = (c[1] + 2 * c[2] * t) / unit;
+        accel[a] = 2 * c[2] / (unit * unit);
+    }
+    return (kinematic_t) {
+        .pos = { .x = pos[0], .y = pos[1], .z = pos[2] },
+        .vel = { .x = vel[0], .y = vel[1], .z = vel[2] },
+        .accel = { .x = accel[0], .y = accel[1], .z = accel[2] },
+    };
+}
+
+// Covariance of each axis's motion in `window_state`. An axis's positions are
+// taken to spread as far as its residuals show, but never less than `noise`
+// (in mm), since a handful of residuals can sit close to the fit by chance.
+static void window_covariance(const window_fit_t *w, const fit_result_t *fit, float noise, float cov[3][3][3])
+{
+    const float unit = FIT_TIME_UNIT / 1e6f;  // in secs
+    float t = window_newest(w);
+    // Derivatives of position, velocity and acceleration by c0, c1, c2
+    const float j[3][3] = {
+        { 1, t, t * t },
+        { 0, 1 / unit, 2 * t / unit },
+        { 0, 0, 2 / (unit * unit) },
+    };
+    float jinv[3][3], jinvj[3][3];
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            jinv[r][c] = 0;
+            for (int k = 0; k < 3; k++) jinv[r][c] += j[r][k] * fit->inverse[k][c];
+        }
+    }
+    for (int r = 0; r < 3; r++) {
+        for (int c = 0; c < 3; c++) {
+            jinvj[r][c] = 0;
+            for (int k = 0; k < 3; k++) jinvj[r][c] += jinv[r][k] * j[c][k];
+        }
+    }
+    for (int a = 0; a < 3; a++) {
+        float var = square(max(fit->residuals[a], noise));
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) cov[a][r][c] = var * jinvj[r][c];
+        }
+        // BALLISTIC pins acceleration to `gravity`, which is only known to `GRAVITY_UNCERTAINTY`
+        if (BALLISTIC) cov[a][2][2] += square(GRAVITY_UNCERTAINTY);
+    }
+}
+
+
+// --------------- END WINDOW FIT MODULE ---------------
+
+
+// --------------- BEGIN TRACKING MODULE ---------------
+enum {
+    ESTIMATOR_KALMAN,
+    ESTIMATOR_WINDOW_FIT,
+};
+
+// Constant-acceleration Kalman filter over the object's position. The model
+// and the noise are the same on every axis and each position reading measures
+// the axes independently, so each axis gets its own 3-state filter. BALLISTIC
+// starts the acceleration state at `gravity`, only as uncertain as
+// `GRAVITY_UNCERTAINTY`, and holds it constant, so the track settles on
+// position and velocity quickly while still correcting a slightly wrong `gravity`.
+// Times here are in seconds: velocities in mm/s and accelerations in mm/s^2.
+
+// Spread of a single position reading, in mm
+#define MEASUREMENT_NOISE 10.0f
+// Spectral density of the jerk (rate of change of acceleration) allowed for,
+// in mm^2/s^5: lets acceleration drift by about 1 m/s^2 over 100 ms, which
+// covers drag and spin without making the estimate jumpy
+#define JERK_NOISE 1e7f
+// Spectral density of the acceleration left over from gravity (drag, spin) in
+// BALLISTIC mode, in mm^2/s^3: lets velocity drift by about 50 mm/s over 100 ms
+#define DRAG_NOISE 2.5e4f
+// Spread of the velocity and acceleration the first reading of a track is
+// assumed to have (in mm/s and mm/s^2): anything a thrown ball could do
+#define INITIAL_VEL_NOISE 5000.0f
+#define INITIAL_ACCEL_NOISE 20000.0f
+// A track with no position for this long (in microsecs) is dropped
+#define TRACK_MAX_GAP 100000
+// Fewest positions a track needs before it is used for a prediction; the window
+// fit also needs one more position than coefficients to have any residual at all
+#define TRACK_MIN_UPDATES (ESTIMATOR == ESTIMATOR_WINDOW_FIT ? FIT_MIN_WINDOW : 3)
+// Most positions in a row a track waits to follow its readings again (see
+// `tracker_rough`) before predicting anyway, with a radius widened to match
+#ifndef TRACK_MAX_ROUGH
+#define TRACK_MAX_ROUGH FIT_MAX_WINDOW
+#endif
+// Positions the Kalman filter's running innovation is smoothed over
+#define TRACK_RESIDUAL_SMOOTHING 3
+// The Kalman filter's counterpart to `FIT_RESIDUAL_THRESHOLD`: worst squared
+// innovation (how far a position lands from where the track expected it),
+// in units of its expected variance, over which the filter no longer follows
+// the object. Readings within 3 standard deviations are in line.
+#define TRACK_INNOVATION_THRESHOLD 9.0f
+
+typedef struct {
+    float state[3];         // Position, velocity, acceleration
+    float cov[3][3];        // Covariance of `state`
+} axis_filter_t;
+
+typedef struct {
+    axis_filter_t axes[3];  // x, y, z
+    window_fit_t window;    // Used instead of `axes` by ESTIMATOR_WINDOW_FIT
+    fit_result_t fit;       // Latest solve of `window`
+    bool solved;            // Whether the latest position gave a usable estimate
+    float innovation_sq;    // ESTIMATOR_KALMAN ONLY: Running mean of the worst axis's normalized squared innovation
+    float residual_sq[3];   // ESTIMATOR_KALMAN ONLY: Per axis running mean square distance of positions from the estimate
+    int n_rough;            // Positions in a row the estimate didn't follow (see `tracker_rough`)
+    int n_updates;          // Positions folded in; 0 if there is no track
+    unsigned timestamp;     // Of the last position folded in
+    bool have_prev;         // Whether `prev_dists`/`prev_times` hold a frame
+    int prev_dists[N_SENSORS];      // Raw previous frame, for time alignment
+    unsigned prev_times[N_SENSORS];
+} tracker_t;
+
+// `accel` is this axis's component of `gravity`, which BALLISTIC mode starts it at
+static void axis_start(axis_filter_t *axis, float pos, float accel)
+{
+    *axis = (axis_filter_t) {
+        .state = { pos, 0, BALLISTIC ? accel : 0 },
+        .cov = {
+            { square(MEASUREMENT_NOISE), 0, 0 },
+            { 0, square(INITIAL_VEL_NOISE), 0 },
+            { 0, 0, square(BALLISTIC ? GRAVITY_UNCERTAINTY : INITIAL_ACCEL_NOISE) },
+        },
+    };
+}
+
+// Moves `axis` forward `dt` seconds: state = F state, cov = F cov F^T + Q
+static void axis_predict(axis_filter_t *axis, float dt)
+{
+    const float f[3][3] = {
+        { 1, dt, dt * dt / 2 },
+        { 0, 1, dt },
+        { 0, 0, 1 },
+    };
+    float dt2 = dt * dt, dt3 = dt2 * dt;
+    float q[3][3] = {{0}};
+    if (BALLISTIC) {
+        // White-noise acceleration on top of gravity; the acceleration state is constant
+        q[0][0] = DRAG_NOISE * dt3 / 3;
+        q[0][1] = q[1][0] = DRAG_NOISE * dt2 / 2;
+        q[1][1] = DRAG_NOISE * dt;
+    } else {
+        // Discrete white-noise jerk model
+        const float jerk[3][3] = {
+            { dt3 * dt2 / 20, dt2 * dt2 / 8, dt3 / 6 },
+            { dt2 * dt2 / 8, dt3 / 3, dt2 / 2 },
+            { dt3 / 6, dt2 / 2, dt },
+        };
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) q[r][c] = JERK_NOISE * jerk[r][c];
+        }
+    }
+
+    float state[3], fp[3][3];
+    for (int r = 0; r < 3; r++) {
+        state[r] = 0;
+        for (int k = 0; k < 3; k++) {
+            state[r] += f[r][k] * axis->state[k];
+        }
+        for (int c = 0; c < 3; c++) {
+            fp[r][c] = 0;
+            for (int k = 0; k < 3; k++) fp[r][c] += f[r][k] * axis->cov[k][c];
+        }
+    }
+    for (int r = 0; r < 3; r++) {
+        axis->state[r] = state[r];
+        for (int c = 0; c < 3; c++) {
+            float sum = q[r][c];
+            for (int k = 0; k < 3; k++) sum += fp[r][k] * f[c][k];
+            axis->cov[r][c] = sum;
+        }
+    }
+}
+
+// Folds a position reading into `axis`. Only position is measured, so the
+// gain is just the first column of the covariance over the innovation variance.
+// Returns the squared innovation over its variance, i.e. how surprising the
+// reading was before it was folded in: about 1 while the model holds. Writes
+// how far the reading is from the updated position to `residual`.
+static float axis_update(axis_filter_t *axis, float pos, float *residual)
+{
+    float innovation_var = axis->cov[0][0] + square(MEASUREMENT_NOISE);
+    float gain[3];
+    for (int r = 0; r < 3; r++) gain[r] = axis->cov[r][0] / innovation_var;
+    float innovation = pos - axis->state[0];
+    float cov_row[3] = { axis->cov[0][0], axis->cov[0][1], axis->cov[0][2] };
+    for (int r = 0; r < 3; r++) {
+        axis->state[r] += gain[r] * innovation;
+        for (int c = 0; c < 3; c++) axis->cov[r][c] -= gain[r] * cov_row[c];
+    }
+    *residual = pos - axis->state[0];
+    return square(innovation) / innovation_var;
+}
+
+static void tracker_reset(tracker_t *tracker)
+{
+    tracker->n_updates = 0;
+    tracker->have_prev = false;
+}
+
+// Whether the estimate doesn't follow the newest positions as well as the
+// sensors' noise allows
+static bool tracker_rough(const tracker_t *tracker)
+{
+    if (ESTIMATOR == ESTIMATOR_WINDOW_FIT) {
+        const float *r = tracker->fit.residuals;
+        return max(r[0], max(r[1], r[2])) > FIT_RESIDUAL_THRESHOLD;
+    }
+    return tracker->innovation_sq > TRACK_INNOVATION_THRESHOLD;
+}
+
+// Whether the track is worth predicting from: enough positions, a good solve of
+// the newest one, and residuals that look like sensor noise. A track that stays
+// rough (drag, spin, a bounce) is used anyway after `TRACK_MAX_ROUGH` positions.
+static bool tracker_ready(const tracker_t *tracker)
+{
+    return tracker->solved && tracker->n_updates >= TRACK_MIN_UPDATES
+        && (tracker->n_rough == 0 || tracker->n_rough >= TRACK_MAX_ROUGH);
+}
+
+// Folds one frame from the sensor array into the track: aligns it in time
+// against the previous frame, solves it for a position, and runs one
+// predict/update step (or refits the window). Returns true if the frame gave
+// a position; `tracker_ready` tells whether the track is usable.
+static bool tracker_add_frame(tracker_t *tracker, const sonic_data_t *frame)
+{
+    int dists[2][N_SENSORS], aligned[2][N_SENSORS];
+    unsigned times[2][N_SENSORS], timestamps[2];
+    for (int i = 0; i < N_SENSORS; i++) {
+        dists[0][i] = tracker->prev_dists[i];
+        times[0][i] = tracker->prev_times[i];
+        dists[1][i] = tracker->prev_dists[i] = frame[i].distance;
+        times[1][i] = tracker->prev_times[i] = frame[i].timestamp;
+    }
+    // Only the previous frame is available, so every sensor is aligned against it
+    if (tracker->have_prev) {
+        resample_frames(dists, times, 2, aligned, timestamps);
+    } else {
+        resample_frames(dists + 1, times + 1, 1, aligned + 1, timestamps + 1);
+    }
+    tracker->have_prev = true;
+
+    vec_3d_t pos;
+    if (!position_from_dists(aligned[1], &pos)) return false;
+    unsigned timestamp = timestamps[1];
+    float coords[3] = { pos.x, pos.y, pos.z };
+    if (tracker->n_updates > 0 && timestamp - tracker->timestamp > TRACK_MAX_GAP) tracker->n_updates = 0;
+    if (tracker->n_updates == 0) tracker->n_rough = 0;
+    if (ESTIMATOR == ESTIMATOR_WINDOW_FIT) {
+        if (tracker->n_updates == 0) window_reset(&tracker->window);
+        window_add(&tracker->window, timestamp, pos);
+        tracker->solved = window_solve(&tracker->window, &tracker->fit);
+        if (tracker->solved) window_adapt(&tracker->window, &tracker->fit);
+    } else if (tracker->n_updates == 0) {
+        const float g[3] = { gravity.x, gravity.y, gravity.z };
+        for (int a = 0; a < 3; a++) axis_start(&tracker->axes[a], coords[a], g[a]);
+        // A new track has to show it is in line before it is trusted
+        tracker->innovation_sq = TRACK_INNOVATION_THRESHOLD;
+        for (int a = 0; a < 3; a++) tracker->residual_sq[a] = 0;
+        tracker->solved = true;
+    } else {
+        float dt = (timestamp - tracker->timestamp) / 1e6f;
+        float worst = 0;
+        for (int a = 0; a < 3; a++) {
+            axis_predict(&tracker->axes[a], dt);
+            float residual;
+            float innovation_sq = axis_update(&tracker->axes[a], coords[a], &residual);
+            worst = max(worst, innovation_sq);
+            tracker->residual_sq[a] += (square(residual) - tracker->residual_sq[a]) / TRACK_RESIDUAL_SMOOTHING;
+        }
+        tracker->innovation_sq += (worst - tracker->innovation_sq) / TRACK_RESIDUAL_SMOOTHING;
+    }
+    tracker->timestamp = timestamp;
+    tracker->n_updates++;
+    if (tracker->solved && tracker_rough(tracker)) tracker->n_rough++;
+    else if (tracker->solved) tracker->n_rough = 0;
+    return true;
+}
+
+// Current estimate of the object's motion
+static kinematic_t tracker_state(const tracker_t *tracker)
+{
+    if (ESTIMATOR == ESTIMATOR_WINDOW_FIT) return window_state(&tracker->window, &tracker->fit);
+    const axis_filter_t *x = &tracker->axes[0], *y = &tracker->axes[1], *z = &tracker->axes[2];
+    return (kinematic_t) {
+        .pos = { .x = x->state[0], .y = y->state[0], .z = z->state[0] },
+        .vel = { .x = x->state[1], .y = y->state[1], .z = z->state[1] },
+        .accel = { .x = x->state[2], .y = y->state[2], .z = z->state[2] },
+    };
+}
+
+// Covariance of each axis's position, velocity and acceleration in `tracker_state`
+static void tracker_covariance(const tracker_t *tracker, float cov[3][3][3])
+{
+    if (ESTIMATOR == ESTIMATOR_WINDOW_FIT) {
+        window_covariance(&tracker->window, &tracker->fit, MEASUREMENT_NOISE, cov);
+        return;
+    }
+    // The filter's own covariance assumes readings spread by `MEASUREMENT_NOISE`;
+    // where the residuals show they spread further, widen it to match, as
+    // `window_covariance` does for the fit
+    for (int a = 0; a < 3; a++) {
+        float scale = max(tracker->residual_sq[a], square(MEASUREMENT_NOISE)) / square(MEASUREMENT_NOISE);
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 3; c++) cov[a][r][c] = scale * tracker->axes[a].cov[r][c];
+        }
+    }
+}
+// --------------- END TRACKING MODULE ---------------
+
+
 // --------------- BEGIN PUBLIC API ---------------
+// Latest impact time reported, in secs; keeps `time_to_impact` from overflowing
+// when the object is barely closing on the board
+#define MAX_IMPACT_TIME 60.0f
+
+static sonic_array_t *sonic;
+static tracker_t tracker;
+
+void object_vector_init(sonic_sensor_t sensors[])
+{
+    build_pseudo_inverses();
+    build_fix_pseudo_inverses();
+    sonic = sonic_init(sensors, N_SENSORS);
+#if CONCURRENT_FIRING
+    sonic_set_schedule(sonic, pair_schedule, N_SENSORS / 2);
+#else
+    sonic_set_schedule(sonic, sequential_schedule, N_SENSORS);
+#endif
+    sonic_set_range_gate(sonic, SONIC_DEFAULT_TARGET_SPEED);
+    // Knock out single-frame spikes before they reach the geometry
+    sonic_set_filter(sonic, FILTER_WINDOW, FILTER_THRESHOLD);
+    // Tightest timing the room allows; the board must be clear at startup
+    if (!sonic_calibrate(sonic)) sonic_set_unit_delay(sonic, FALLBACK_UNIT_DELAY);
+    // Walls and ceiling echo at fixed distances; frames with fewer than 3 echoes
+    // in front of that clutter are dropped before any geometry is done on them
+    sonic_set_background(sonic, true);
+    sonic_set_idle_scan(sonic, pair_schedule, N_IDLE_GROUPS, IDLE_CYCLE_DELAY, MAX_SENSE_DEPTH);
+    sonic_on(sonic);
+}
+
+void object_vector_set_recording(bool on)
+{
+    sonic_set_recording(sonic, on);
+}
+
 // Returns false if no intersection with board and therefore nothing to write to `prediction`. Also
-// returns false if it couldn't get enough reliable data to make a prediction. Returns true
-// if a valid prediction was made and the hoop should be moved
-#define N_BURST_SAMPLES 7
-bool object_vector_predict(board_pos_t *prediction)
-{
-    // TODO: In addition to pruning data for only valid position readings as below,
-    // do a linear regression and discard outliers. If r value is below a
-    // certain minimum threshold, or there are so many outliers discarded that
-    // there are less than 3 remaining position vectors, the function fails.
-
-    // TODO: If burst method doesn't work, try retrying position reading until
-    // enough valid positions are found? They don't necessarily have to be
-    // super close together...
-
-    sonic_data_t *array_readings[N_BURST_SAMPLES];
-    // 3 passed as 3rd arg because >=3 sensors needed to triangulate position on any given read
-    if (!sonic_read_sync_multiple(array_readings, N_BURST_SAMPLES, 3)) return false;
-    // Keep only valid position readings from total number of readings
-    vec_3d_t positions[N_BURST_SAMPLES];
-    int n_positions = 0;
-    for (int i = 0; i < N_BURST_SAMPLES; i++) {
-        if (pos_from_dists(array_readings[i], &positions[n_positions])) n_positions++;
-    }
-
-    // Assemble timestamp array
-    unsigned timestamps[N_BURST_SAMPLES];
-    for (int i = 0; i < n_positions; i++) {
-        // `N_SENSORS / 2` to use middle sensor for position timestamp
-        timestamps[i] = array_readings[i][N_SENSORS / 2].timestamp;
-    }
-    for (int i = 0; i < N_BURST_SAMPLES; i++) {
-        free(array_readings[i]);
-    }
-    kinematic_t trajec = trajec_from_positions(positions, timestamps, n_positions);
-    if (!intersec_from_trajec(trajec, prediction)) return false;
+// returns false if there is no new reading or not enough of a track yet to make a prediction.
+// Returns true if a valid prediction was made; its radius tells how far to trust it
+bool object_vector_predict(prediction_t *prediction)
+{
+    if (!sonic_is_tracking(sonic)) {
+        // Nothing in range; discard idle-scan frames and start the next track afresh
+        sonic_data_t *stale;
+        while (sonic_read_async(sonic, &stale)) sonic_release(sonic, stale);
+        tracker_reset(&tracker);
+        return false;
+    }
+    // Fold in every frame that has arrived since the last call, then predict from the newest estimate
+    bool updated = false;
+    sonic_data_t *frame;
+    while (sonic_read_async(sonic, &frame)) {
+        updated |= tracker_add_frame(&tracker, frame);
+        sonic_release(sonic, frame);
+    }
+    if (!updated || !tracker_ready(&tracker)) return false;
+    kinematic_t state = tracker_state(&tracker);
+    float time;
+    if (!intersec_from_trajec(state, &prediction->landing, &time)) return false;
+    float cov[3][3][3];
+    tracker_covariance(&tracker, cov);
+    prediction->radius = intersec_spread(state, cov, time);
+    prediction->time_to_impact = min(time, MAX_IMPACT_TIME) * 1e6f;
+    prediction->timestamp = tracker.timestamp;
 
     // Convert from bottom-left-corner origin coordinate system to center-of-rect origin coord system
     // (needed by motors to drive hoop)
-    prediction->x -= RECT_WIDTH / 2;
-    prediction->y -= RECT_HEIGHT / 2;
+    prediction->landing.x -= RECT_WIDTH / 2;
+    prediction->landing.y -= RECT_HEIGHT / 2;
     return true;
 }
 // --------------- END PUBLIC API ---------------
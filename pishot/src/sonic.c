@@ -3,208 +3,976 @@
 #include "gpioextra.h"
 #include "malloc.h"
 #include "sonic.h"
+#include "sonic_filter.h"
+#include "sonic_log.h"
 #include "sonic_rb.h"
+#include "sonic_rec.h"
 #include "strings.h"
 #include "timer.h"
+#include "utils.h"
 
 /*
  * Written by Adam Shugar on March 11, 2020.
  */
 
-// All times in state struct are in microseconds
-struct sonic_config {
+// Callback run by the timer dispatcher when an array's deadline passes
+typedef void (*array_timer_fn)(sonic_array_t *);
+
+// Running counters behind each sensor's `sonic_sensor_stats_t`
+typedef struct {
+    unsigned n_fired;
+    unsigned n_echoes;
+    unsigned n_timeouts;
+    unsigned n_skipped;
+    unsigned n_filtered;
+    unsigned n_background;
+    unsigned echo_histogram[SONIC_STATS_BUCKETS];
+    unsigned last_trigger;              // Timestamp of most recent trigger
+    unsigned last_interval;             // Time between the two most recent triggers
+    unsigned n_intervals;
+    unsigned long long interval_sum;
+    unsigned long long jitter_sum;
+    unsigned jitter_max;
+} sensor_counters_t;
+
+// All times in array struct are in microseconds
+struct sonic_array {
     sonic_sensor_t *sensors;                // Array of sensor metadata (maps GPIO pins to each sensor)
     int n_sensors;                          // Total number of sensors (size of `sensors` arr)
     sonic_rb_t *arr_readings;               // ASYNC ONLY: Cumulative collection of sensor array data for all past loops
-    sonic_data_t *curr_data;                // ASYNC ONLY: Array of sensor data for current loop (maps to sensor arr)
-    int curr_sensor;                        // ASYNC ONLY: Index of current sensor
-    unsigned curr_trigger_timestamp;        // ASYNC ONLY: Timestamp of curr reading start to calculate dt
-    bool awaiting_echo;                     // ASYNC ONLY: Whether we have sent a trigger and are awaiting response
-    bool is_active;                         // ASYNC ONLY: Whether entire module is "on" or "off"
-    bool handler_attached;                  // ASYNC ONLY: Flag turned on after interrupt handler attached to prevent duplicates
+    sonic_rb_t *free_frames;                // ASYNC ONLY: Pool frames neither queued in `arr_readings` nor held by client
+    sonic_data_t *frame_pool;               // ASYNC ONLY: Backing store for all `SONIC_POOL_FRAMES` frames
+    sonic_data_t *scratch_data;             // ASYNC ONLY: Throwaway frame filled when the pool is exhausted
+    sonic_data_t *curr_data;                // ASYNC ONLY: Frame being assembled by the bottom half (maps to sensor arr)
+    unsigned rise_timestamps[SONIC_MAX_SENSORS]; // ASYNC ONLY: Bottom half's record of when each sensor's echo pulse began
+    unsigned rose;                          // ASYNC ONLY: Bottom half's record of sensors whose echo pulse began since their trigger
+    sonic_log_t *events;                    // ASYNC ONLY: Raw events captured by the top half, awaiting the bottom half
+    bool logging;                           // ASYNC ONLY: Whether the top half records events for the current cycle
+    unsigned dropped_cycles;                // ASYNC ONLY: Cycles dropped from (or never logged to) the full event log
+    sonic_data_t *latest_data;              // ASYNC ONLY: Copy of most recently completed frame, guarded by `latest_seq`
+    volatile unsigned latest_seq;           // ASYNC ONLY: Seqlock counter for `latest_data`; odd while a write is in progress
+    volatile unsigned n_published;          // ASYNC ONLY: Total frames completed by the read loop
+    unsigned n_latest_read;                 // ASYNC ONLY: Value of `n_published` at the client's last snapshot
+    unsigned latest_overruns;               // ASYNC ONLY: Total frames completed but never seen via `sonic_read_latest`
+    unsigned schedule[SONIC_MAX_SENSORS];   // Sensor bitmask for each group fired together, in firing order
+    int n_groups;                           // Number of groups in one full-array cycle (size of `schedule` arr)
+    const unsigned *curr_schedule;          // ASYNC ONLY: Schedule used by the current cycle (`schedule` or `idle_schedule`)
+    int curr_n_groups;                      // ASYNC ONLY: Number of groups in `curr_schedule`
+    int curr_group;                         // ASYNC ONLY: Index of current group in `curr_schedule`
+    unsigned curr_fired;                    // ASYNC ONLY: Sensors of current group actually triggered (live or probed)
+    unsigned curr_busy;                     // ASYNC ONLY: Sensors of current group whose echo pin was still high when triggered
+    volatile unsigned curr_rose;            // ASYNC ONLY: Sensors of current group whose echo pin has risen since the trigger
+    unsigned curr_trigger_timestamp;        // ASYNC ONLY: Timestamp of curr group's trigger, for range gate
+    volatile unsigned awaiting_echo;        // ASYNC ONLY: Bitmask of sensors in current group triggered but not yet echoed
+    bool is_active;                         // ASYNC ONLY: Whether this array is "on" or "off"
+    array_timer_fn timer_callback;          // ASYNC ONLY: Next step of this array's read loop; NULL if none pending
+    unsigned timer_deadline;                // ASYNC ONLY: Timer reading at which `timer_callback` is due
     unsigned cycle_delay;                   // Delay between end of 1st full-arr reading and start of 2nd
     unsigned unit_delay;                    // Delay between each sensor reading
+    unsigned guard[SONIC_MAX_SENSORS][SONIC_MAX_SENSORS]; // Calibrated delay between a sensor finishing and another firing
+    bool calibrated;                        // Whether `guard` replaces `unit_delay`
     unsigned timeout;                       // Max time to wait before moving to next sensor reading
+    unsigned max_target_speed;              // Range gate speed bound in mm per millisecond; 0 if gating is off
+    unsigned retry_age;                     // SYNC ONLY: Oldest valid reading kept when retrying a frame; 0 to re-fire everything
+    int last_distance[SONIC_MAX_SENSORS];   // Most recent distance from each sensor (`SONIC_INVALID_READING` after a miss)
+    unsigned last_timestamp[SONIC_MAX_SENSORS]; // Timestamp of `last_distance` for each sensor
+    unsigned timeout_streak[SONIC_MAX_SENSORS]; // Consecutive timeouts without an echo pulse for each sensor
+    volatile unsigned dead_sensors;         // Bitmask of sensors excluded from the schedule for never answering
+    unsigned last_probe;                    // Timestamp of the last cycle that fired dead sensors too
+    bool probing;                           // Whether the current cycle fires dead sensors too
+    sensor_counters_t counters[SONIC_MAX_SENSORS]; // Per-sensor statistics since `stats_reset_time`
+    unsigned stats_reset_time;              // Timestamp of last `sonic_reset_stats`
+    unsigned stats_base_published;          // `n_published` at last reset
+    unsigned stats_base_dropped;            // `dropped_cycles` at last reset
+    unsigned stats_base_overruns;           // `latest_overruns` at last reset
+    unsigned stats_base_pool_overruns;      // `pool_overruns` at last reset
+    unsigned pool_overruns;                 // ASYNC ONLY: Frames dropped because the client held every pool frame
+    volatile unsigned isr_count;            // ASYNC ONLY: Interrupts serviced for this array since last reset
+    volatile unsigned long long isr_time_sum; // ASYNC ONLY: Total time spent servicing them
+    volatile unsigned isr_time_max;         // ASYNC ONLY: Longest of them
+    sonic_filter_t filters[SONIC_MAX_SENSORS];  // Recent echoes from each sensor
+    int filter_window;                      // Samples the spike filter looks at; 0 if filtering is off
+    unsigned filter_threshold;              // Spike threshold, in scaled MADs
+    sonic_background_t backgrounds[SONIC_MAX_SENSORS]; // ASYNC ONLY: Learned static scene in front of each sensor
+    bool background_on;                     // ASYNC ONLY: Whether echoes matching the background are reported invalid
+    unsigned curr_skipped;                  // ASYNC ONLY: Sensors skipped in the frame being assembled by the bottom half
+    bool recording;                         // Whether every completed frame is streamed over the UART
+    sonic_rec_t recorder;                   // Encoder state for the recorded stream
+    sonic_data_t raw_frame[SONIC_MAX_SENSORS]; // Frame being read, before the spike filter and background subtraction
+    unsigned idle_schedule[SONIC_MAX_SENSORS]; // ASYNC ONLY: Groups scanned while no target is in range
+    int n_idle_groups;                      // ASYNC ONLY: Number of groups in `idle_schedule`; 0 if rate control is off
+    unsigned idle_cycle_delay;              // ASYNC ONLY: Cycle delay used while idle
+    unsigned entry_range;                   // ASYNC ONLY: Distance in mm within which a target counts as present
+    volatile bool tracking;                 // ASYNC ONLY: Whether the full schedule is running (always true without rate control)
+    unsigned entry_windows[SONIC_MAX_SENSORS]; // ASYNC ONLY: Latest each sensor's echo can fall after its trigger and count as a target
+    bool target_seen;                       // ASYNC ONLY: Whether any echo this cycle came from a target within `entry_range`
+    unsigned lost_cycles;                   // ASYNC ONLY: Consecutive tracking cycles without a target in range
 };
-static struct sonic_config state;
 
-static void start_timer(unsigned micros, handler_fn_t callback)
+// State shared by every array: all arrays share one GPIO interrupt handler
+// and one ARM countdown timer, multiplexed by the dispatchers below
+struct sonic_shared {
+    sonic_array_t *arrays[SONIC_MAX_ARRAYS]; // Every initialized array; NULL for unused slots
+    bool handler_attached;                  // Flag turned on after interrupt handler attached to prevent duplicates
+    bool dispatching;                       // Whether `dispatch_timer` is running (it re-arms once at the end)
+};
+static struct sonic_shared shared;
+
+// Prevents the compiler from moving memory accesses across this point. The Pi's
+// single core sees its own writes in order, so this is all the seqlock needs.
+#define COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// Disables IRQs and returns the previous CPSR, for a critical section in main
+// context that the read loop's interrupt handlers must not run in the middle of.
+// Unlike `interrupts_global_enable`, `irq_restore` leaves IRQs off if they were
+// off before (e.g. `sonic_on` runs before the client enables interrupts).
+static inline unsigned irq_save(void)
+{
+    unsigned cpsr;
+    __asm__ __volatile__("mrs %0, cpsr\n\tcpsid i" : "=r"(cpsr) :: "memory");
+    return cpsr;
+}
+
+static inline void irq_restore(unsigned cpsr)
+{
+    __asm__ __volatile__("msr cpsr_c, %0" :: "r"(cpsr) : "memory");
+}
+
+static void record_isr(sonic_array_t *arr, unsigned elapsed)
+{
+    arr->isr_count++;
+    arr->isr_time_sum += elapsed;
+    if (elapsed > arr->isr_time_max) arr->isr_time_max = elapsed;
+}
+
+// ---------------- BEGIN TIMER DISPATCHER ----------------
+// Each array keeps its own deadline; the single countdown timer is always
+// armed for whichever deadline is soonest. `sonic_on` and `sonic_off` reach
+// the dispatcher from main context, where another array's interrupt could
+// otherwise re-arm the timer in the middle of a scan and leave it armed for
+// a stale deadline, so every change is made with IRQs off.
+static bool dispatch_timer(unsigned int pc);
+
+// Caller must have IRQs off (interrupt context, or between `irq_save` and `irq_restore`)
+static void rearm_timer(void)
 {
+    unsigned now = timer_get_ticks();
+    bool pending = false;
+    int soonest = 0;
+    for (int a = 0; a < SONIC_MAX_ARRAYS; a++) {
+        sonic_array_t *arr = shared.arrays[a];
+        if (arr == NULL || arr->timer_callback == NULL) continue;
+        int remaining = (int)(arr->timer_deadline - now);
+        if (!pending || remaining < soonest) soonest = remaining;
+        pending = true;
+    }
+    if (!pending) {
+        countdown_disable();
+        return;
+    }
     // Assume that while this module is active the client is not
     // setting other interrupt-based timers or otherwise using the
     // ARM timer module.
-    countdown_set_ticks(micros);
-    countdown_set_handler(callback);
+    countdown_set_ticks(max(soonest, 1));
+    countdown_set_handler(dispatch_timer);
     countdown_enable();
 }
 
-// ---------------- BEGIN READ LOOP FUNCTIONS ----------------
+static bool dispatch_timer(unsigned int pc)
+{
+    shared.dispatching = true;
+    unsigned now = timer_get_ticks();
+    for (int a = 0; a < SONIC_MAX_ARRAYS; a++) {
+        sonic_array_t *arr = shared.arrays[a];
+        if (arr == NULL || arr->timer_callback == NULL) continue;
+        if ((int)(arr->timer_deadline - now) > 0) continue;
+        array_timer_fn callback = arr->timer_callback;
+        arr->timer_callback = NULL;
+        unsigned start = timer_get_ticks();
+        callback(arr);
+        record_isr(arr, timer_get_ticks() - start);
+    }
+    shared.dispatching = false;
+    rearm_timer();
+    return true;
+}
+
+// Runs `callback` for `arr` in `micros` microseconds
+static void start_timer(sonic_array_t *arr, unsigned micros, array_timer_fn callback)
+{
+    unsigned cpsr = irq_save();
+    arr->timer_callback = callback;
+    arr->timer_deadline = timer_get_ticks() + micros;
+    if (!shared.dispatching) rearm_timer();
+    irq_restore(cpsr);
+}
+
+static void cancel_timer(sonic_array_t *arr)
+{
+    unsigned cpsr = irq_save();
+    arr->timer_callback = NULL;
+    if (!shared.dispatching) rearm_timer();
+    irq_restore(cpsr);
+}
+// ---------------- END TIMER DISPATCHER ----------------
+
 // Forward references for callbacks
-static bool finish_trigger(unsigned int);
-static bool timeout(unsigned int);
-static void next_sensor(void);
+static void fire_group(sonic_array_t *);
+static void timeout(sonic_array_t *);
+static void next_group(sonic_array_t *);
 // Drive trigger pin on HC-SR04 high for >= 10 microsecs to send a pulse per datasheet
 #define TRIGGER_DELAY 10
-static bool start_trigger(unsigned int pc)
+// Longest the async read loop holds trigger pins high while waiting out the
+// delay before a group. Longer delays raise the triggers right before firing.
+#define TRIGGER_MAX_HOLD 5000
+#define SPEED_MM_MICRO .343 // Speed of sound in mm per microsecond
+
+// Writes `value` to the trigger pin of every sensor in bitmask `group`
+static void write_triggers(sonic_array_t *arr, unsigned group, unsigned value)
 {
-    // Break out of the interrupt-based loop at beginning of routine
-    // for a single sensor if client turned module off
-    if (!state.is_active) return true;
-    gpio_write(state.sensors[state.curr_sensor].trigger, 1);
-    start_timer(TRIGGER_DELAY, finish_trigger);
-    return true;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if (group & SONIC_SENSOR_BIT(i)) gpio_write(arr->sensors[i].trigger, value);
+    }
 }
 
-static bool finish_trigger(unsigned int pc)
-{ 
-    if (!state.is_active) return true;
+// ---------------- BEGIN SENSOR BOOKKEEPING ----------------
+// Shared by the sync read path and the async bottom half; never run in
+// interrupt context.
 
-    gpio_write(state.sensors[state.curr_sensor].trigger, 0);
-    state.curr_trigger_timestamp = timer_get_ticks();
-    state.awaiting_echo = true;
-    start_timer(state.timeout, timeout);
-    return true;
+// Fills in `sensor`'s entry of `frame` for an echo pulse that rose at
+// `rise_timestamp` and fell at `fall_timestamp`. The HC-SR04 raises echo
+// once its burst has been sent and drops it when the reflection arrives, so
+// the pulse width is the true time of flight, excluding the sensor's own
+// setup delay after the trigger.
+static void record_echo(sonic_array_t *arr, sonic_data_t *frame, int sensor, unsigned rise_timestamp, unsigned fall_timestamp)
+{
+    unsigned elapsed = fall_timestamp - rise_timestamp;
+    // Pulse travelled there and back (hence div. 2)
+    frame[sensor].distance = (int) ((elapsed * SPEED_MM_MICRO) / 2);
+    // Pulse hit object at halfway between start and end timestamps
+    frame[sensor].timestamp = rise_timestamp + (elapsed / 2);
+    arr->raw_frame[sensor] = frame[sensor];
+    arr->last_distance[sensor] = frame[sensor].distance;
+    arr->last_timestamp[sensor] = frame[sensor].timestamp;
+    arr->counters[sensor].n_echoes++;
+    arr->counters[sensor].echo_histogram[min(elapsed / SONIC_STATS_BUCKET_WIDTH, SONIC_STATS_BUCKETS - 1)]++;
+    // Any echo at all brings a dead sensor back into the schedule
+    arr->timeout_streak[sensor] = 0;
+    arr->dead_sensors &= ~SONIC_SENSOR_BIT(sensor);
+    // Range gate and health track the raw echo; only the reported distance is filtered
+    if (arr->filter_window) {
+        int filtered = sonic_filter_sample(&arr->filters[sensor], arr->filter_window, arr->filter_threshold, frame[sensor].distance);
+        if (filtered != frame[sensor].distance) arr->counters[sensor].n_filtered++;
+        frame[sensor].distance = filtered;
+    }
 }
 
-static bool timeout(unsigned int pc)
+// A sensor whose echo pin `rose` but didn't fall in time is alive with nothing
+// in range (the HC-SR04 holds echo high for ~38 ms when nothing reflects), so
+// only a sensor that never started an echo pulse counts toward being dead
+static void record_timeout(sonic_array_t *arr, sonic_data_t *frame, int sensor, unsigned trigger_timestamp, bool rose)
 {
-    if (!state.awaiting_echo) return true;
+    frame[sensor].distance = SONIC_INVALID_READING;
+    frame[sensor].timestamp = trigger_timestamp;
+    arr->raw_frame[sensor] = frame[sensor];
+    // Target lost; listen for the full window next time
+    arr->last_distance[sensor] = SONIC_INVALID_READING;
+    arr->counters[sensor].n_timeouts++;
+    if (rose) {
+        arr->timeout_streak[sensor] = 0;
+        arr->dead_sensors &= ~SONIC_SENSOR_BIT(sensor);
+    } else if (++arr->timeout_streak[sensor] >= SONIC_DEAD_STREAK) {
+        arr->dead_sensors |= SONIC_SENSOR_BIT(sensor);
+    }
+}
 
-    state.awaiting_echo = false;
-    state.curr_data[state.curr_sensor].distance = SONIC_INVALID_READING;
-    state.curr_data[state.curr_sensor].timestamp = state.curr_trigger_timestamp;
-    next_sensor();
-    return true;
+// Entry for a sensor that was left out of the schedule this cycle
+static void record_skipped(sonic_array_t *arr, sonic_data_t *frame, int sensor, unsigned timestamp)
+{
+    frame[sensor].distance = SONIC_INVALID_READING;
+    frame[sensor].timestamp = timestamp;
+    arr->raw_frame[sensor] = frame[sensor];
+    arr->counters[sensor].n_skipped++;
+}
+
+// Tracks the spacing between `sensor`'s triggers; jitter is how much each
+// interval differs from the one before it
+static void record_fired(sonic_array_t *arr, int sensor, unsigned trigger_timestamp)
+{
+    sensor_counters_t *c = &arr->counters[sensor];
+    if (c->n_fired > 0) {
+        unsigned interval = trigger_timestamp - c->last_trigger;
+        if (c->n_intervals > 0) {
+            unsigned jitter = abs((int)(interval - c->last_interval));
+            c->jitter_sum += jitter;
+            c->jitter_max = max(c->jitter_max, jitter);
+        }
+        c->interval_sum += interval;
+        c->n_intervals++;
+        c->last_interval = interval;
+    }
+    c->last_trigger = trigger_timestamp;
+    c->n_fired++;
 }
+// ---------------- END SENSOR BOOKKEEPING ----------------
 
-static void next_sensor(void)
+// Called at the start of every full-array cycle: decides whether this cycle
+// also fires dead sensors, to check whether they have come back
+static void begin_cycle(sonic_array_t *arr, unsigned now)
 {
-    if (!state.is_active) return;
+    arr->probing = arr->dead_sensors && now - arr->last_probe >= SONIC_DEAD_PROBE_INTERVAL;
+    if (arr->probing) arr->last_probe = now;
+}
 
-    unsigned delay;
-    if (state.curr_sensor == state.n_sensors - 1) {
-        sonic_data_t *complete_cycle = malloc(sizeof(sonic_data_t) * state.n_sensors);
-        memcpy(complete_cycle, state.curr_data, sizeof(sonic_data_t) * state.n_sensors);
-        bool success = sonic_rb_enqueue(state.arr_readings, complete_cycle);
-        if (!success) free(complete_cycle);
-        state.curr_sensor = 0;
-        // Delay for cycle time before starting new cycle
-        delay = state.cycle_delay < SONIC_MIN_DELAY ? state.unit_delay : state.cycle_delay;
+// Returns the sensors of `group` that should actually be triggered this cycle
+static unsigned fire_mask(sonic_array_t *arr, unsigned group)
+{
+    return arr->probing ? group : group & ~arr->dead_sensors;
+}
+
+// Slack added to every range gate, in microseconds. Covers the sensor's delay
+// between trigger and echo (~0.5 ms) plus reading noise.
+#define RANGE_GATE_SLACK 1000
+// Returns how long after its trigger an echo from `range` mm away can arrive
+static unsigned range_window(unsigned range)
+{
+    // Integer form of round trip (2 * range) / SPEED_MM_MICRO; no floats in the ISR
+    return range * 2000 / 343 + RANGE_GATE_SLACK;
+}
+
+// Returns how long to listen for `sensor`'s echo if it is triggered at `now`.
+// While a target is being tracked, it can't have moved farther than the max
+// target speed allows since its last reading, so the window only needs to
+// cover that range; after a miss the full timeout is used.
+static unsigned sensor_timeout(sonic_array_t *arr, int sensor, unsigned now)
+{
+    if (arr->max_target_speed == 0 || arr->last_distance[sensor] == SONIC_INVALID_READING) {
+        return arr->timeout;
+    }
+    unsigned since_last_ms = (now - arr->last_timestamp[sensor]) / 1000;
+    // A target that could have left the full window's range is as good as lost;
+    // clamping there also keeps the products below from wrapping after a long gap
+    unsigned full_range = (arr->timeout / 1000 + 1) * 343 / 2;
+    since_last_ms = min(since_last_ms, full_range / arr->max_target_speed + 1);
+    unsigned max_range = arr->last_distance[sensor] + arr->max_target_speed * since_last_ms;
+    return min(range_window(max_range), arr->timeout);
+}
+
+// Delay between the end of group `from` and the firing of group `to`: the
+// calibrated guard time for the slowest sensor pair, or the unit delay if the
+// array hasn't been calibrated
+static unsigned transition_delay(sonic_array_t *arr, unsigned from, unsigned to)
+{
+    if (!arr->calibrated) return arr->unit_delay;
+    unsigned delay = SONIC_MIN_DELAY;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if (!(from & SONIC_SENSOR_BIT(i))) continue;
+        for (int j = 0; j < arr->n_sensors; j++) {
+            if (to & SONIC_SENSOR_BIT(j)) delay = max(delay, arr->guard[i][j]);
+        }
+    }
+    return delay;
+}
+
+// Listen window for a whole group: long enough for its farthest sensor
+static unsigned group_timeout(sonic_array_t *arr, unsigned group, unsigned now)
+{
+    unsigned window = 0;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if (group & SONIC_SENSOR_BIT(i)) window = max(window, sensor_timeout(arr, i, now));
+    }
+    return window;
+}
+
+// ---------------- BEGIN BACKGROUND MODEL ----------------
+// Each sensor's background (modelled in sonic_filter.c) is learned by the
+// bottom half from the frames it assembles and read by the top half through
+// `entry_windows`.
+
+// Recomputes how soon after its trigger `sensor`'s echo must fall to count as
+// a target: from within the entry range, and clearly in front of the
+// background. An echo off the background itself falls the sensor's setup delay
+// (~0.5 ms) after its round trip, while this window closes the margin's round
+// trip (~1.5 ms) less the gate slack before it.
+static void update_entry_window(sonic_array_t *arr, int sensor)
+{
+    unsigned window = range_window(arr->entry_range);
+    int background = arr->backgrounds[sensor].distance;
+    if (arr->background_on && background != SONIC_INVALID_READING) {
+        window = background > SONIC_BACKGROUND_MARGIN ? min(window, range_window(background - SONIC_BACKGROUND_MARGIN)) : 0;
+    }
+    arr->entry_windows[sensor] = window;
+}
+
+static void seed_background(sonic_array_t *arr, int sensor, int distance)
+{
+    sonic_background_seed(&arr->backgrounds[sensor], distance, timer_get_ticks());
+    update_entry_window(arr, sensor);
+}
+
+// Updates every sensor's background from `frame`
+static void learn_background(sonic_array_t *arr, const sonic_data_t *frame)
+{
+    for (int i = 0; i < arr->n_sensors; i++) {
+        // A skipped sensor says nothing about the scene
+        if (arr->curr_skipped & SONIC_SENSOR_BIT(i)) continue;
+        if (sonic_background_learn(&arr->backgrounds[i], arr->entry_range, frame[i].distance, frame[i].timestamp)) {
+            update_entry_window(arr, i);
+        }
+    }
+}
+
+// Reports every echo in `frame` that isn't clearly in front of its sensor's
+// background as invalid
+static void subtract_background(sonic_array_t *arr, sonic_data_t *frame)
+{
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if (sonic_background_hides(&arr->backgrounds[i], frame[i].distance)) {
+            frame[i].distance = SONIC_INVALID_READING;
+            arr->counters[i].n_background++;
+        }
+    }
+}
+// ---------------- END BACKGROUND MODEL ----------------
+
+// ---------------- BEGIN READ LOOP FUNCTIONS (TOP HALF) ----------------
+// Everything here runs in interrupt context. It only drives the firing
+// schedule and timestamps raw events into the log; the bottom half does all
+// conversion, validation and frame assembly later.
+
+// Most events one cycle can log: a trigger, busy, skip and timeout per group,
+// a rise and fall per sensor, the idle scan's skip, and the cycle end
+#define MAX_CYCLE_EVENTS(n_groups, n_sensors) (4 * (n_groups) + 2 * (n_sensors) + 2)
+
+static void log_event(sonic_array_t *arr, unsigned kind, unsigned sensors, unsigned timestamp)
+{
+    if (!arr->logging) return;
+    sonic_log_enqueue(arr->events, (sonic_event_t) {
+        .sensors = sensors, .kind = kind, .timestamp = timestamp });
+}
+
+// Called at the end of every cycle. Switches to the full schedule as soon as
+// an idle scan sees a target within the entry range, and back to the idle
+// scan once `SONIC_TRACK_LOST_CYCLES` cycles in a row have seen nothing.
+static void update_rate(sonic_array_t *arr)
+{
+    if (arr->n_idle_groups == 0) return;
+    if (arr->target_seen) {
+        arr->tracking = true;
+        arr->lost_cycles = 0;
+    } else if (arr->tracking && ++arr->lost_cycles >= SONIC_TRACK_LOST_CYCLES) {
+        arr->tracking = false;
+    }
+    arr->target_seen = false;
+}
+
+// Starts a new cycle in the read loop. A cycle is only logged once the log has
+// room for all of it, so the bottom half never sees a partial frame. If the
+// bottom half has fallen behind, the oldest cycles are dropped to make that
+// room: the newest data is what the client needs (see `sonic_read_latest`).
+// Every cycle writes every sensor's entry in the frame, so a cycle dropped
+// partway through its processing is simply overwritten by the next one.
+static void begin_async_cycle(sonic_array_t *arr, unsigned now)
+{
+    begin_cycle(arr, now);
+    if (arr->tracking) {
+        arr->curr_schedule = arr->schedule;
+        arr->curr_n_groups = arr->n_groups;
     } else {
-        state.curr_sensor++;
-        delay = state.unit_delay;
+        arr->curr_schedule = arr->idle_schedule;
+        arr->curr_n_groups = arr->n_idle_groups;
     }
-    start_timer(delay, start_trigger);
+    unsigned needed = MAX_CYCLE_EVENTS(arr->curr_n_groups, arr->n_sensors);
+    while (sonic_log_space(arr->events) < needed && sonic_log_drop_cycle(arr->events)) {
+        arr->dropped_cycles++;
+    }
+    // Only possible if a single cycle could overflow the log
+    arr->logging = sonic_log_space(arr->events) >= needed;
+    if (!arr->logging) arr->dropped_cycles++;
+    if (arr->tracking) return;
+
+    // Sensors left out of the idle scan still need an entry in the frame
+    unsigned unscanned = SONIC_SENSOR_BIT(arr->n_sensors) - 1;
+    for (int g = 0; g < arr->curr_n_groups; g++) {
+        unscanned &= ~arr->curr_schedule[g];
+    }
+    if (unscanned) log_event(arr, SONIC_EVENT_SKIP, unscanned, now);
 }
-// ---------------- END READ LOOP FUNCTIONS ----------------
 
+// The HC-SR04 fires when its trigger falls, so the trigger pulse doubles as
+// the delay before each group: the group's triggers go high as soon as the
+// delay starts and drop when its timer expires. This costs one timer interrupt
+// per group rather than a second one just to end the pulse.
+static void raise_triggers(sonic_array_t *);
 
-#define SPEED_MM_MICRO .343 // Speed of sound in mm per microsecond
-static bool process_echo(unsigned pc)
+// Schedules the current group to fire in `delay` microsecs
+static void arm_group(sonic_array_t *arr, unsigned delay)
 {
-    // Only handle cases meant for this module
-    if (!state.is_active) return false;
+    arr->curr_fired = fire_mask(arr, arr->curr_schedule[arr->curr_group]);
+    delay = max(delay, TRIGGER_DELAY);
+    if (delay <= TRIGGER_MAX_HOLD) {
+        write_triggers(arr, arr->curr_fired, 1);
+        start_timer(arr, delay, fire_group);
+    } else {
+        start_timer(arr, delay - TRIGGER_DELAY, raise_triggers);
+    }
+}
 
-    // Noise on a pin; ignore event
-    if (!state.awaiting_echo) {
-        for (int i = 0; i < state.n_sensors; i++) {
-            gpio_clear_event(state.sensors[i].echo);
+// Only reached after long delays; a pulse this short is cheaper to wait out
+// here than to schedule
+static void raise_triggers(sonic_array_t *arr)
+{
+    if (!arr->is_active) return;
+    write_triggers(arr, arr->curr_fired, 1);
+    timer_delay_us(TRIGGER_DELAY);
+    fire_group(arr);
+}
+
+static void fire_group(sonic_array_t *arr)
+{
+    // Break out of the interrupt-based loop at beginning of routine
+    // for a single group if client turned module off
+    if (!arr->is_active) return;
+
+    write_triggers(arr, arr->curr_fired, 0);
+    unsigned skipped = arr->curr_schedule[arr->curr_group] & ~arr->curr_fired;
+    if (skipped) log_event(arr, SONIC_EVENT_SKIP, skipped, timer_get_ticks());
+    // Whole group is dead; move straight on rather than waiting out a timeout
+    if (!arr->curr_fired) {
+        next_group(arr);
+        return;
+    }
+    arr->curr_trigger_timestamp = timer_get_ticks();
+    arr->awaiting_echo = arr->curr_fired;
+    arr->curr_rose = 0;
+    // An HC-SR04 still holding its echo pin high from an earlier ping (up to
+    // ~38 ms with nothing in range) ignores the trigger; the end of that old
+    // pulse must not be mistaken for an echo
+    arr->curr_busy = 0;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if ((arr->curr_fired & SONIC_SENSOR_BIT(i)) && gpio_read(arr->sensors[i].echo) == 1) {
+            arr->curr_busy |= SONIC_SENSOR_BIT(i);
         }
-        return true;
     }
+    log_event(arr, SONIC_EVENT_TRIGGER, arr->curr_fired, arr->curr_trigger_timestamp);
+    if (arr->curr_busy) log_event(arr, SONIC_EVENT_BUSY, arr->curr_busy, arr->curr_trigger_timestamp);
+    unsigned window = group_timeout(arr, arr->awaiting_echo, arr->curr_trigger_timestamp);
+    // Idle scans only look for something entering range
+    if (!arr->tracking) window = min(window, range_window(arr->entry_range));
+    start_timer(arr, window, timeout);
+}
+
+static void timeout(sonic_array_t *arr)
+{
+    if (!arr->awaiting_echo) return;
+
+    // Every sensor in the group that hasn't echoed yet missed this cycle
+    log_event(arr, SONIC_EVENT_TIMEOUT, arr->awaiting_echo, timer_get_ticks());
+    arr->awaiting_echo = 0;
+    next_group(arr);
+}
+
+static void next_group(sonic_array_t *arr)
+{
+    if (!arr->is_active) return;
+
+    unsigned delay;
+    if (arr->curr_group == arr->curr_n_groups - 1) {
+        unsigned now = timer_get_ticks();
+        log_event(arr, SONIC_EVENT_CYCLE_END, 0, now);
+        arr->curr_group = 0;
+        update_rate(arr);
+        begin_async_cycle(arr, now);
+        // Delay for cycle time before starting new cycle, but never less than the guard time
+        delay = arr->tracking ? arr->cycle_delay : arr->idle_cycle_delay;
+        unsigned guard = transition_delay(arr, arr->curr_fired, arr->curr_schedule[0]);
+        if (delay < SONIC_MIN_DELAY) delay = guard;
+        else if (arr->calibrated) delay = max(delay, guard);
+    } else {
+        arr->curr_group++;
+        delay = transition_delay(arr, arr->curr_fired, arr->curr_schedule[arr->curr_group]);
+    }
+    arm_group(arr, delay);
+}
 
+// Handles any echo events on `arr`'s pins. Returns true if there were any.
+static bool process_array_echo(sonic_array_t *arr)
+{
+    // Every sensor in a group is timed independently: check each echo pin
+    // and clear every event so stray edges (noise on a pin, or a late echo
+    // from a previous group) are discarded rather than re-raised. Both edges
+    // are detected; the pin's current level tells which one this was.
     unsigned echo_timestamp = timer_get_ticks();
-    unsigned elapsed = echo_timestamp - state.curr_trigger_timestamp;
-    // Pulse travelled there and back (hence div. 2)
-    state.curr_data[state.curr_sensor].distance = (int) ((elapsed * SPEED_MM_MICRO) / 2);
-    // Pulse hit object at halfway between start and end timestamps
-    state.curr_data[state.curr_sensor].timestamp = state.curr_trigger_timestamp + (elapsed / 2);
+    unsigned rose = 0, fell = 0;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if (!gpio_check_and_clear_event(arr->sensors[i].echo)) continue;
+        if (gpio_read(arr->sensors[i].echo) == 1) rose |= SONIC_SENSOR_BIT(i);
+        else fell |= SONIC_SENSOR_BIT(i);
+    }
+    if (!rose && !fell) return false;
+    rose &= arr->awaiting_echo;
+    fell &= arr->awaiting_echo;
+    arr->curr_rose |= rose;
+    // A busy sensor's old pulse ending isn't an echo; it has no reading this
+    // time and is left to time out
+    fell &= ~(arr->curr_busy & ~arr->curr_rose);
+    if (rose) log_event(arr, SONIC_EVENT_RISE, rose, echo_timestamp);
+    if (!fell) return true;
 
-    state.awaiting_echo = false;
-    gpio_clear_event(state.sensors[state.curr_sensor].echo);
-    next_sensor();
+    log_event(arr, SONIC_EVENT_FALL, fell, echo_timestamp);
+    unsigned elapsed = echo_timestamp - arr->curr_trigger_timestamp;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if ((fell & SONIC_SENSOR_BIT(i)) && elapsed <= arr->entry_windows[i]) arr->target_seen = true;
+    }
+    arr->awaiting_echo &= ~fell;
+    // Last sensor of the group has echoed; move on without waiting for the timeout
+    if (!arr->awaiting_echo) next_group(arr);
     return true;
 }
 
-bool sonic_init(sonic_sensor_t sensors[], int n_sensors)
+// Single GPIO handler shared by every array
+static bool process_echo(unsigned pc)
+{
+    bool handled = false;
+    // Only handle cases meant for this module
+    for (int a = 0; a < SONIC_MAX_ARRAYS; a++) {
+        sonic_array_t *arr = shared.arrays[a];
+        if (arr == NULL || !arr->is_active) continue;
+        unsigned start = timer_get_ticks();
+        if (process_array_echo(arr)) {
+            record_isr(arr, timer_get_ticks() - start);
+            handled = true;
+        }
+    }
+    return handled;
+}
+// ---------------- END READ LOOP FUNCTIONS (TOP HALF) ----------------
+
+
+// ---------------- BEGIN BOTTOM HALF ----------------
+// Hands the frame assembled during the cycle that just finished to the client
+// and claims a fresh one from the pool. The ring of finished frames is longer
+// than the pool, so enqueueing a pool frame can never fail.
+static void publish_frame(sonic_array_t *arr)
 {
-    if (n_sensors > SONIC_MAX_SENSORS || n_sensors <= 0) return false;
-    if (!state.handler_attached) {
+    if (arr->recording) sonic_rec_frame(&arr->recorder, arr->raw_frame);
+    if (arr->background_on) {
+        learn_background(arr, arr->curr_data);
+        subtract_background(arr, arr->curr_data);
+    }
+    arr->curr_skipped = 0;
+    // Latest-frame snapshot is overwritten even if the FIFO below has to drop this cycle
+    arr->latest_seq++;
+    COMPILER_BARRIER();
+    memcpy(arr->latest_data, arr->curr_data, sizeof(sonic_data_t) * arr->n_sensors);
+    arr->n_published++;
+    COMPILER_BARRIER();
+    arr->latest_seq++;
+
+    if (arr->curr_data != arr->scratch_data) {
+        sonic_rb_enqueue(arr->arr_readings, arr->curr_data);
+    }
+    // Client is holding every frame; keep reading but drop cycles until one is released
+    if (arr->curr_data == arr->scratch_data) arr->pool_overruns++;
+    if (!sonic_rb_dequeue(arr->free_frames, &arr->curr_data)) {
+        arr->curr_data = arr->scratch_data;
+    }
+}
+
+// Dequeues the next event for the bottom half. The top half may drop old
+// cycles from the log at any time, so it is kept out for the dequeue.
+static bool next_event(sonic_array_t *arr, sonic_event_t *event)
+{
+    unsigned cpsr = irq_save();
+    bool dequeued = sonic_log_dequeue(arr->events, event);
+    irq_restore(cpsr);
+    return dequeued;
+}
+
+void sonic_process(sonic_array_t *arr)
+{
+    sonic_event_t event;
+    while (next_event(arr, &event)) {
+        if (event.kind == SONIC_EVENT_CYCLE_END) {
+            publish_frame(arr);
+            continue;
+        }
+        for (int i = 0; i < arr->n_sensors; i++) {
+            if (!(event.sensors & SONIC_SENSOR_BIT(i))) continue;
+            switch (event.kind) {
+                case SONIC_EVENT_TRIGGER:
+                    record_fired(arr, i, event.timestamp);
+                    // If both edges land before one interrupt is serviced, only the
+                    // fall is seen; the trigger time is the best remaining estimate
+                    arr->rise_timestamps[i] = event.timestamp;
+                    arr->rose &= ~SONIC_SENSOR_BIT(i);
+                    break;
+                case SONIC_EVENT_RISE:
+                    arr->rise_timestamps[i] = event.timestamp;
+                    arr->rose |= SONIC_SENSOR_BIT(i);
+                    break;
+                case SONIC_EVENT_BUSY:
+                    // Still answering its previous ping, so certainly alive
+                    arr->rose |= SONIC_SENSOR_BIT(i);
+                    break;
+                case SONIC_EVENT_FALL:
+                    record_echo(arr, arr->curr_data, i, arr->rise_timestamps[i], event.timestamp);
+                    break;
+                case SONIC_EVENT_TIMEOUT:
+                    record_timeout(arr, arr->curr_data, i, arr->rise_timestamps[i], arr->rose & SONIC_SENSOR_BIT(i));
+                    break;
+                case SONIC_EVENT_SKIP:
+                    record_skipped(arr, arr->curr_data, i, event.timestamp);
+                    arr->curr_skipped |= SONIC_SENSOR_BIT(i);
+                    break;
+            }
+        }
+    }
+}
+// ---------------- END BOTTOM HALF ----------------
+
+sonic_array_t *sonic_init(sonic_sensor_t sensors[], int n_sensors)
+{
+    if (n_sensors > SONIC_MAX_SENSORS || n_sensors <= 0) return NULL;
+    int slot = 0;
+    while (slot < SONIC_MAX_ARRAYS && shared.arrays[slot] != NULL) slot++;
+    if (slot == SONIC_MAX_ARRAYS) return NULL;
+
+    if (!shared.handler_attached) {
         interrupts_attach_handler(process_echo, INTERRUPTS_GPIO3);
-        state.handler_attached = true;
+        shared.handler_attached = true;
     }
+    sonic_array_t *arr = malloc(sizeof(struct sonic_array));
+    memset(arr, 0, sizeof(struct sonic_array));
     for (int i = 0; i < n_sensors; i++) {
         gpio_set_output(sensors[i].trigger);
         gpio_set_input(sensors[i].echo);
         // Set pulldown b/c `echo` is driven high by sensor
         gpio_set_pulldown(sensors[i].echo);
     }
-    state.sensors = malloc(sizeof(sonic_sensor_t) * n_sensors);
-    memcpy(state.sensors, sensors, sizeof(sonic_sensor_t) * n_sensors);
-    state.curr_data = malloc(sizeof(sonic_data_t) * n_sensors);
-    state.arr_readings = sonic_rb_new();
-    state.n_sensors = n_sensors;
-    state.timeout = SONIC_DEFAULT_TIMEOUT;
-    state.unit_delay = SONIC_MIN_DELAY;
+    arr->sensors = malloc(sizeof(sonic_sensor_t) * n_sensors);
+    memcpy(arr->sensors, sensors, sizeof(sonic_sensor_t) * n_sensors);
+    arr->arr_readings = sonic_rb_new();
+    arr->free_frames = sonic_rb_new();
+    arr->frame_pool = malloc(sizeof(sonic_data_t) * n_sensors * SONIC_POOL_FRAMES);
+    for (int i = 0; i < SONIC_POOL_FRAMES; i++) {
+        sonic_rb_enqueue(arr->free_frames, arr->frame_pool + i * n_sensors);
+    }
+    arr->scratch_data = malloc(sizeof(sonic_data_t) * n_sensors);
+    sonic_rb_dequeue(arr->free_frames, &arr->curr_data);
+    arr->latest_data = malloc(sizeof(sonic_data_t) * n_sensors);
+    arr->events = sonic_log_new();
+    arr->n_sensors = n_sensors;
+    // Default schedule fires each sensor alone, in registration order
+    for (int i = 0; i < n_sensors; i++) {
+        arr->schedule[i] = SONIC_SENSOR_BIT(i);
+    }
+    arr->n_groups = n_sensors;
+    arr->timeout = SONIC_DEFAULT_TIMEOUT;
+    arr->unit_delay = SONIC_MIN_DELAY;
+    arr->tracking = true;
+    for (int i = 0; i < n_sensors; i++) {
+        seed_background(arr, i, SONIC_INVALID_READING);
+    }
+    sonic_reset_stats(arr);
+    shared.arrays[slot] = arr;
+    return arr;
+}
+
+void sonic_deinit(sonic_array_t *arr)
+{
+    sonic_off(arr);
+    for (int a = 0; a < SONIC_MAX_ARRAYS; a++) {
+        if (shared.arrays[a] == arr) shared.arrays[a] = NULL;
+    }
+    free(arr->sensors);
+    // Every frame handed out (queued, held by client, or current) lives in the pool
+    free(arr->frame_pool);
+    free(arr->scratch_data);
+    free(arr->latest_data);
+    free((void *)arr->arr_readings);
+    free((void *)arr->free_frames);
+    free((void *)arr->events);
+    free(arr);
+}
+
+int sonic_sensor_count(sonic_array_t *arr)
+{
+    return arr->n_sensors;
+}
+
+void sonic_set_unit_delay(sonic_array_t *arr, unsigned micros)
+{
+    if (micros < SONIC_MIN_DELAY) return;
+    arr->unit_delay = micros;
+    arr->calibrated = false;
+}
+
+void sonic_set_cycle_delay(sonic_array_t *arr, unsigned micros)
+{
+    arr->cycle_delay = micros;
+}
+
+// Returns the sensors covered by `groups`, or 0 if any group is empty, names
+// an unregistered sensor, or overlaps another group
+static unsigned schedule_coverage(sonic_array_t *arr, const unsigned groups[], int n_groups)
+{
+    unsigned all_sensors = SONIC_SENSOR_BIT(arr->n_sensors) - 1;
+    unsigned covered = 0;
+    for (int i = 0; i < n_groups; i++) {
+        if (groups[i] == 0 || (groups[i] & ~all_sensors) || (groups[i] & covered)) return 0;
+        covered |= groups[i];
+    }
+    return covered;
+}
+
+bool sonic_set_schedule(sonic_array_t *arr, const unsigned groups[], int n_groups)
+{
+    if (arr->is_active || n_groups <= 0 || n_groups > SONIC_MAX_SENSORS) return false;
+    if (schedule_coverage(arr, groups, n_groups) != SONIC_SENSOR_BIT(arr->n_sensors) - 1) return false;
+
+    memcpy(arr->schedule, groups, sizeof(unsigned) * n_groups);
+    arr->n_groups = n_groups;
+    return true;
+}
+
+bool sonic_set_idle_scan(sonic_array_t *arr, const unsigned groups[], int n_groups, unsigned cycle_delay, unsigned entry_range)
+{
+    if (arr->is_active || n_groups < 0 || n_groups > SONIC_MAX_SENSORS) return false;
+    if (n_groups > 0 && schedule_coverage(arr, groups, n_groups) == 0) return false;
+
+    memcpy(arr->idle_schedule, groups, sizeof(unsigned) * n_groups);
+    arr->n_idle_groups = n_groups;
+    arr->idle_cycle_delay = cycle_delay;
+    arr->entry_range = entry_range;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        update_entry_window(arr, i);
+    }
+    // Without an idle scan the full schedule always runs
+    arr->tracking = n_groups == 0;
+    return true;
+}
+
+bool sonic_is_tracking(sonic_array_t *arr)
+{
+    return arr->tracking;
+}
+
+void sonic_set_timeout(sonic_array_t *arr, unsigned micros)
+{
+    arr->timeout = micros;
+}
+
+void sonic_set_range_gate(sonic_array_t *arr, unsigned max_speed)
+{
+    arr->max_target_speed = max_speed;
+}
+
+bool sonic_set_filter(sonic_array_t *arr, int window, unsigned threshold)
+{
+    if (window < 0 || window == 1 || window == 2 || window > SONIC_FILTER_MAX_WINDOW) return false;
+    arr->filter_window = window;
+    arr->filter_threshold = threshold;
+    memset(arr->filters, 0, sizeof(arr->filters));
     return true;
 }
 
-void sonic_deinit(void)
+void sonic_set_background(sonic_array_t *arr, bool on)
 {
-    sonic_off();
-    free(state.sensors);
-    free(state.curr_data);
-    sonic_data_t *to_free;
-    while (sonic_read_async(&to_free)) free(to_free);
-    free((void *)state.arr_readings);
+    arr->background_on = on;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        update_entry_window(arr, i);
+    }
 }
 
-int sonic_sensor_count(void)
+bool sonic_get_background(sonic_array_t *arr, int sensor, int *distance)
 {
-    return state.n_sensors;
+    if (!arr->background_on || sensor < 0 || sensor >= arr->n_sensors) return false;
+    *distance = arr->backgrounds[sensor].distance;
+    return true;
 }
 
-void sonic_set_unit_delay(unsigned micros)
+void sonic_set_recording(sonic_array_t *arr, bool on)
 {
-    if (micros >= SONIC_MIN_DELAY) state.unit_delay = micros;
+    // Every recording starts with a fresh header, so it decodes on its own
+    if (on && !arr->recording) sonic_rec_start(&arr->recorder, arr->n_sensors);
+    arr->recording = on;
 }
 
-void sonic_set_cycle_delay(unsigned micros)
+void sonic_set_retry_age(sonic_array_t *arr, unsigned micros)
 {
-    state.cycle_delay = micros;
+    arr->retry_age = micros;
 }
 
-void sonic_set_timeout(unsigned micros)
+unsigned sonic_valid_mask(sonic_array_t *arr, const sonic_data_t *frame)
 {
-    state.timeout = micros;
+    unsigned valid = 0;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if (frame[i].distance != SONIC_INVALID_READING) valid |= SONIC_SENSOR_BIT(i);
+    }
+    return valid;
 }
 
-void sonic_on(void)
+// Returns true if any array other than `arr` is currently on
+static bool others_active(sonic_array_t *arr)
 {
-    state.is_active = true;
-    state.curr_sensor = 0;
-    countdown_reset(TRIGGER_DELAY);
-    countdown_set_mode(COUNTDOWN_MODE_DISCONTINUOUS);
-    for (int i = 0; i < state.n_sensors; i++) {
-        gpio_enable_event_detection(state.sensors[i].echo, GPIO_DETECT_FALLING_EDGE);
+    for (int a = 0; a < SONIC_MAX_ARRAYS; a++) {
+        if (shared.arrays[a] != NULL && shared.arrays[a] != arr && shared.arrays[a]->is_active) return true;
     }
-    start_trigger(0); // pc argument is just to match interface; pass dummy value
+    return false;
 }
 
-void sonic_off(void)
+void sonic_on(sonic_array_t *arr)
 {
-    countdown_disable();
-    countdown_disable_interrupts();
-    countdown_set_handler(NULL);
-    for (int i = 0; i < state.n_sensors; i++) {
-        gpio_disable_event_detection(state.sensors[i].echo, GPIO_DETECT_FALLING_EDGE);
+    if (arr->is_active) return;
+    // First array to turn on takes over the countdown timer
+    if (!others_active(arr)) {
+        countdown_reset(TRIGGER_DELAY);
+        countdown_set_mode(COUNTDOWN_MODE_DISCONTINUOUS);
+    }
+    arr->is_active = true;
+    arr->curr_group = 0;
+    arr->awaiting_echo = 0;
+    // Every run starts idle and waits for a target to show up
+    arr->tracking = arr->n_idle_groups == 0;
+    arr->target_seen = false;
+    begin_async_cycle(arr, timer_get_ticks());
+    for (int i = 0; i < arr->n_sensors; i++) {
+        gpio_enable_event_detection(arr->sensors[i].echo, GPIO_DETECT_RISING_EDGE);
+        gpio_enable_event_detection(arr->sensors[i].echo, GPIO_DETECT_FALLING_EDGE);
+    }
+    arm_group(arr, TRIGGER_DELAY);
+}
+
+void sonic_off(sonic_array_t *arr)
+{
+    arr->is_active = false;
+    cancel_timer(arr);
+    // Loop may have been stopped partway through a trigger pulse
+    write_triggers(arr, SONIC_SENSOR_BIT(arr->n_sensors) - 1, 0);
+    // Last array to turn off releases the countdown timer
+    if (!others_active(arr)) {
+        countdown_disable();
+        countdown_disable_interrupts();
+        countdown_set_handler(NULL);
+    }
+    for (int i = 0; i < arr->n_sensors; i++) {
+        gpio_disable_event_detection(arr->sensors[i].echo, GPIO_DETECT_RISING_EDGE);
+        gpio_disable_event_detection(arr->sensors[i].echo, GPIO_DETECT_FALLING_EDGE);
     }
-    state.is_active = false;
 }
 
-bool sonic_is_active(void)
+bool sonic_is_active(sonic_array_t *arr)
 {
-    return state.is_active;
+    return arr->is_active;
+}
+
+bool sonic_get_health(sonic_array_t *arr, int sensor, sonic_health_t *health)
+{
+    if (sensor < 0 || sensor >= arr->n_sensors) return false;
+    health->is_alive = !(arr->dead_sensors & SONIC_SENSOR_BIT(sensor));
+    health->timeout_streak = arr->timeout_streak[sensor];
+    return true;
 }
 
 static inline bool did_timeout(unsigned start, unsigned timeout)
@@ -212,60 +980,370 @@ static inline bool did_timeout(unsigned start, unsigned timeout)
     return timer_get_ticks() - start >= timeout;
 }
 
-// The `min_valid` is the minimum number of sensors in array
-// that must give valid readings (i.e. not time out); otherwise
-// the entire reading is considered useless and is redone until
-// the criterion is satisfied.
-bool sonic_read_sync(sonic_data_t **read_dest, int min_valid)
+// Fires `group` and polls every echo pin in it at once: a sensor is done once
+// its echo pin has gone high and then low again, or once its window (indexed by
+// sensor) closes. A pin must be seen low after the trigger before a rise
+// counts, so the tail of a pulse from an earlier ping (during which the sensor
+// ignores the trigger) is never timed as an echo. Time of flight is the width
+// of the echo pulse. Writes the time the trigger ended to `p_start`, each
+// echoing sensor's edge times to `rise` and `fall`, and the sensors whose echo
+// pin was high at all (i.e. that are alive) to `p_rose`; returns the sensors
+// that echoed. Leaves sensor state alone.
+static unsigned poll_group(sonic_array_t *arr, unsigned group, const unsigned windows[],
+                           unsigned rise[], unsigned fall[], unsigned *p_start, unsigned *p_rose)
 {
-    // If we're reading in async mode already, we can't do both at once
-    if (state.is_active) return false;
+    write_triggers(arr, group, 1);
+    timer_delay_us(TRIGGER_DELAY);
+    write_triggers(arr, group, 0);
+    unsigned start = timer_get_ticks();
+    *p_start = start;
+
+    unsigned pending = group, seen_low = 0, echo_high = 0, was_high = 0, echoed = 0;
+    while (pending) {
+        for (int i = 0; i < arr->n_sensors; i++) {
+            if (!(pending & SONIC_SENSOR_BIT(i))) continue;
+            if (did_timeout(start, windows[i])) {
+                pending &= ~SONIC_SENSOR_BIT(i);
+            } else if (gpio_read(arr->sensors[i].echo) == 1) {
+                was_high |= SONIC_SENSOR_BIT(i);
+                if (!(seen_low & SONIC_SENSOR_BIT(i)) || (echo_high & SONIC_SENSOR_BIT(i))) continue;
+                rise[i] = timer_get_ticks();
+                echo_high |= SONIC_SENSOR_BIT(i);
+            } else if (echo_high & SONIC_SENSOR_BIT(i)) {
+                fall[i] = timer_get_ticks();
+                echoed |= SONIC_SENSOR_BIT(i);
+                pending &= ~SONIC_SENSOR_BIT(i);
+            } else {
+                seen_low |= SONIC_SENSOR_BIT(i);
+            }
+        }
+    }
+    *p_rose = was_high;
+    return echoed;
+}
+
+// ---------------- BEGIN GUARD TIME CALIBRATION ----------------
+// Quiet time before every calibration ping, long enough for earlier pings to die away
+#define CALIBRATION_QUIET 30000
+// Guard times are found to within this many microseconds
+#define CALIBRATION_RESOLUTION 500
+// Readings that differ by at most this many mm count as the same
+#define CALIBRATION_TOLERANCE 20
+// A guard time must give a clean reading this many times in a row
+#define CALIBRATION_TRIALS 2
+// Most guard times tried for one sensor pair (each takes 130 to 170 ms)
+#define CALIBRATION_MAX_STEPS 6
+
+// Fires `sensor` alone and returns its distance, or `SONIC_INVALID_READING`
+static int calibration_ping(sonic_array_t *arr, int sensor)
+{
+    unsigned windows[SONIC_MAX_SENSORS], rise[SONIC_MAX_SENSORS], fall[SONIC_MAX_SENSORS], start, rose;
+    windows[sensor] = arr->timeout;
+    if (!poll_group(arr, SONIC_SENSOR_BIT(sensor), windows, rise, fall, &start, &rose)) return SONIC_INVALID_READING;
+    return (int) (((fall[sensor] - rise[sensor]) * SPEED_MM_MICRO) / 2);
+}
+
+static bool same_reading(int a, int b)
+{
+    if (a == SONIC_INVALID_READING || b == SONIC_INVALID_READING) return a == b;
+    return abs(a - b) <= CALIBRATION_TOLERANCE;
+}
+
+// Returns true if sensor `to` reads its undisturbed `baseline` every time it is
+// fired `delay` microsecs after sensor `from` finishes. Ring-down (`from` == `to`)
+// and leakage of `from`'s ping into `to` both show up as a changed reading.
+static bool transition_is_clean(sonic_array_t *arr, int from, int to, unsigned delay, int baseline)
+{
+    for (int t = 0; t < CALIBRATION_TRIALS; t++) {
+        timer_delay_us(CALIBRATION_QUIET);
+        calibration_ping(arr, from);
+        timer_delay_us(delay);
+        if (!same_reading(calibration_ping(arr, to), baseline)) return false;
+    }
+    return true;
+}
+
+// Finds the shortest clean guard time from sensor `from` to sensor `to` and
+// writes it to `guard`. Starting from the unit delay, the delay doubles until
+// it reads clean; whatever steps are left then narrow the gap down to the last
+// delay that didn't. Most pairs are clean within a step or two. Returns false
+// if no delay up to the timeout read clean within `CALIBRATION_MAX_STEPS`.
+static bool calibrate_pair(sonic_array_t *arr, int from, int to, int baseline, unsigned *guard)
+{
+    unsigned delay = min(max(arr->unit_delay, CALIBRATION_RESOLUTION), arr->timeout);
+    unsigned unsafe = 0, safe = 0;
+    int steps = 0;
+    while (steps < CALIBRATION_MAX_STEPS) {
+        steps++;
+        if (transition_is_clean(arr, from, to, delay, baseline)) {
+            safe = delay;
+            break;
+        }
+        unsafe = delay;
+        if (delay >= arr->timeout) break;
+        delay = min(delay * 2, arr->timeout);
+    }
+    if (!safe) return false;
+
+    while (steps < CALIBRATION_MAX_STEPS && safe - unsafe > CALIBRATION_RESOLUTION) {
+        steps++;
+        unsigned mid = unsafe + (safe - unsafe) / 2;
+        if (transition_is_clean(arr, from, to, mid, baseline)) safe = mid;
+        else unsafe = mid;
+    }
+    *guard = max(safe, SONIC_MIN_DELAY);
+    return true;
+}
+
+bool sonic_calibrate(sonic_array_t *arr)
+{
+    if (arr->is_active) return false;
+
+    int baseline[SONIC_MAX_SENSORS];
+    for (int j = 0; j < arr->n_sensors; j++) {
+        timer_delay_us(CALIBRATION_QUIET);
+        baseline[j] = calibration_ping(arr, j);
+        // The area is clear, so this is also the best first guess at the background
+        seed_background(arr, j, baseline[j]);
+    }
+    bool converged = true;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        for (int j = 0; j < arr->n_sensors; j++) {
+            if (calibrate_pair(arr, i, j, baseline[j], &arr->guard[i][j])) continue;
+            arr->guard[i][j] = arr->unit_delay;
+            converged = false;
+        }
+    }
+    arr->calibrated = true;
+    return converged;
+}
 
-    sonic_data_t *result = malloc(sizeof(sonic_data_t) * state.n_sensors);
+bool sonic_get_guard(sonic_array_t *arr, int from, int to, unsigned *micros)
+{
+    if (!arr->calibrated || from < 0 || from >= arr->n_sensors || to < 0 || to >= arr->n_sensors) return false;
+    *micros = arr->guard[from][to];
+    return true;
+}
+// ---------------- END GUARD TIME CALIBRATION ----------------
+
+// Reads one frame into `result` by polling. The `min_valid` is the minimum
+// number of sensors in array that must give valid readings (i.e. not time
+// out); otherwise the reading is redone until the criterion is satisfied.
+// Without a retry age the entire reading is considered useless and every
+// sensor is re-fired; with one, valid readings no older than the retry age
+// are kept and only the remaining sensors are re-fired.
+static void read_sync_frame(sonic_array_t *arr, sonic_data_t *result, int min_valid)
+{
     int valid_readings;
+    unsigned kept = 0; // Sensors whose valid reading in `result` is carried over
     do {
-        valid_readings = state.n_sensors;
-        for (int i = 0; i < state.n_sensors; i++) {
-            gpio_write(state.sensors[i].trigger, 1);
-            timer_delay_us(TRIGGER_DELAY);
-            gpio_write(state.sensors[i].trigger, 0);
-            unsigned int start = timer_get_ticks();
-            while (gpio_read(state.sensors[i].echo) == 0
-                && !did_timeout(start, state.timeout)) ;
-            while (gpio_read(state.sensors[i].echo) == 1
-                && !did_timeout(start, state.timeout)) ;
-            unsigned int elapsed = timer_get_ticks() - start;
-
-            if (did_timeout(start, state.timeout)) {
-                result[i].distance = SONIC_INVALID_READING;
-                result[i].timestamp = start;
-                valid_readings--;
-                if (valid_readings < min_valid) break;
-            } else {
-                result[i].distance = (int) ((elapsed * SPEED_MM_MICRO) / 2);
-                result[i].timestamp = start + (elapsed / 2);
+        unsigned now = timer_get_ticks();
+        for (int i = 0; i < arr->n_sensors; i++) {
+            if ((kept & SONIC_SENSOR_BIT(i)) && now - result[i].timestamp > arr->retry_age) {
+                kept &= ~SONIC_SENSOR_BIT(i);
+            }
+        }
+        valid_readings = arr->n_sensors;
+        unsigned echoed = 0;
+        begin_cycle(arr, now);
+        for (int g = 0; g < arr->n_groups; g++) {
+            unsigned wanted = arr->schedule[g] & ~kept;
+            if (!wanted) continue;
+            unsigned group = fire_mask(arr, wanted);
+            // Skipped (dead) sensors count as invalid readings
+            for (int i = 0; i < arr->n_sensors; i++) {
+                if ((wanted & ~group) & SONIC_SENSOR_BIT(i)) {
+                    record_skipped(arr, result, i, timer_get_ticks());
+                    valid_readings--;
+                }
+            }
+            if (valid_readings < min_valid) break;
+            if (!group) continue;
+
+            unsigned windows[SONIC_MAX_SENSORS];
+            unsigned rise[SONIC_MAX_SENSORS], fall[SONIC_MAX_SENSORS], rose;
+            unsigned start = timer_get_ticks() + TRIGGER_DELAY;
+            for (int i = 0; i < arr->n_sensors; i++) {
+                if (group & SONIC_SENSOR_BIT(i)) windows[i] = sensor_timeout(arr, i, start);
             }
+            unsigned group_echoed = poll_group(arr, group, windows, rise, fall, &start, &rose);
 
-            timer_delay_us(state.unit_delay);
+            for (int i = 0; i < arr->n_sensors; i++) {
+                if (group & SONIC_SENSOR_BIT(i)) record_fired(arr, i, start);
+                if (group_echoed & SONIC_SENSOR_BIT(i)) {
+                    record_echo(arr, result, i, rise[i], fall[i]);
+                } else if (group & SONIC_SENSOR_BIT(i)) {
+                    record_timeout(arr, result, i, start, rose & SONIC_SENSOR_BIT(i));
+                    valid_readings--;
+                }
+            }
+            echoed |= group_echoed;
+            if (valid_readings < min_valid) break;
+
+            timer_delay_us(transition_delay(arr, group, arr->schedule[(g + 1) % arr->n_groups]));
         }
+        if (arr->retry_age) kept |= echoed;
     } while (valid_readings < min_valid);
+    if (arr->recording) sonic_rec_frame(&arr->recorder, arr->raw_frame);
+}
+
+bool sonic_read_sync(sonic_array_t *arr, sonic_data_t **read_dest, int min_valid)
+{
+    // If we're reading in async mode already, we can't do both at once
+    if (arr->is_active) return false;
+
+    sonic_data_t *result = malloc(sizeof(sonic_data_t) * arr->n_sensors);
+    read_sync_frame(arr, result, min_valid);
     *read_dest = result;
     return true;
 }
 
-bool sonic_read_sync_multiple(sonic_data_t *read_dests[], int n_readings, int min_valid)
+bool sonic_read_sync_multiple(sonic_array_t *arr, sonic_data_t *read_dests[], int n_readings, int min_valid)
 {
-    if (state.is_active) return false;
+    if (arr->is_active) return false;
     for (int i = 0; i < n_readings; i++) {
         // Assume interrupts are off during sync read; no possible way async mode could have
         // been enabled during this function call, so ignore success flag of `sonic_read_sync`
-        sonic_read_sync(&read_dests[i], min_valid);
-        timer_delay_us(state.cycle_delay);
+        sonic_read_sync(arr, &read_dests[i], min_valid);
+        timer_delay_us(arr->cycle_delay);
+    }
+    return true;
+}
+
+static int count_valid(sonic_array_t *arr, const sonic_data_t *frame)
+{
+    int n_valid = 0;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        if (frame[i].distance != SONIC_INVALID_READING) n_valid++;
+    }
+    return n_valid;
+}
+
+// Copies `frame` into row `f` of a caller's burst buffers
+static void store_burst_frame(sonic_array_t *arr, const sonic_data_t *frame, int f, int distances[], unsigned timestamps[])
+{
+    int *row_distances = distances + f * arr->n_sensors;
+    unsigned *row_timestamps = timestamps + f * arr->n_sensors;
+    for (int i = 0; i < arr->n_sensors; i++) {
+        row_distances[i] = frame[i].distance;
+        row_timestamps[i] = frame[i].timestamp;
+    }
+}
+
+bool sonic_read_burst(sonic_array_t *arr, int distances[], unsigned timestamps[], int n_frames, int min_valid)
+{
+    if (!arr->is_active) {
+        sonic_data_t frame[SONIC_MAX_SENSORS];
+        for (int f = 0; f < n_frames; f++) {
+            if (f > 0) timer_delay_us(arr->cycle_delay);
+            read_sync_frame(arr, frame, min_valid);
+            store_burst_frame(arr, frame, f, distances, timestamps);
+        }
+        return true;
+    }
+
+    int f = 0;
+    sonic_data_t *frame;
+    while (f < n_frames) {
+        // Idle-scan frames don't cover the whole array; a burst only makes sense while tracking
+        if (!arr->tracking) return false;
+        if (!sonic_read_async(arr, &frame)) continue;
+        if (count_valid(arr, frame) >= min_valid) store_burst_frame(arr, frame, f++, distances, timestamps);
+        sonic_release(arr, frame);
+    }
+    return true;
+}
+
+bool sonic_read_async(sonic_array_t *arr, sonic_data_t **read_dest)
+{
+    sonic_process(arr);
+    return sonic_rb_dequeue(arr->arr_readings, read_dest);
+}
+
+void sonic_release(sonic_array_t *arr, sonic_data_t *frame)
+{
+    if (frame != NULL) sonic_rb_enqueue(arr->free_frames, frame);
+}
+
+bool sonic_read_latest(sonic_array_t *arr, sonic_data_t *read_dest)
+{
+    unsigned seq, n_published;
+    sonic_process(arr);
+    // Retry until a copy is made with no frame published partway through it
+    while (true) {
+        seq = arr->latest_seq;
+        COMPILER_BARRIER();
+        if (seq & 1) continue;
+        n_published = arr->n_published;
+        memcpy(read_dest, arr->latest_data, sizeof(sonic_data_t) * arr->n_sensors);
+        COMPILER_BARRIER();
+        if (arr->latest_seq == seq) break;
     }
+
+    if (n_published == arr->n_latest_read) return false;
+    arr->latest_overruns += n_published - arr->n_latest_read - 1;
+    arr->n_latest_read = n_published;
     return true;
 }
 
-bool sonic_read_async(sonic_data_t **read_dest)
+unsigned sonic_latest_overruns(sonic_array_t *arr)
+{
+    return arr->latest_overruns;
+}
+
+// Events per second over `elapsed` microsecs
+static unsigned per_second(unsigned count, unsigned elapsed)
+{
+    return elapsed ? (unsigned)((unsigned long long)count * 1000000 / elapsed) : 0;
+}
+
+void sonic_get_stats(sonic_array_t *arr, sonic_stats_t *stats)
+{
+    sonic_process(arr);
+    // The top half keeps updating the ISR figures (one of them 64-bit) and the drop counters
+    unsigned cpsr = irq_save();
+    unsigned elapsed = timer_get_ticks() - arr->stats_reset_time;
+    stats->elapsed = elapsed;
+    stats->n_frames = arr->n_published - arr->stats_base_published;
+    stats->frames_per_sec = per_second(stats->n_frames, elapsed);
+    stats->dropped_cycles = arr->dropped_cycles - arr->stats_base_dropped;
+    stats->pool_overruns = arr->pool_overruns - arr->stats_base_pool_overruns;
+    stats->latest_overruns = arr->latest_overruns - arr->stats_base_overruns;
+    stats->isr_count = arr->isr_count;
+    stats->isr_time_mean = arr->isr_count ? arr->isr_time_sum / arr->isr_count : 0;
+    stats->isr_time_max = arr->isr_time_max;
+
+    for (int i = 0; i < arr->n_sensors; i++) {
+        sensor_counters_t *c = &arr->counters[i];
+        sonic_sensor_stats_t *out = &stats->sensors[i];
+        unsigned n_readings = c->n_echoes + c->n_timeouts;
+        out->n_fired = c->n_fired;
+        out->n_echoes = c->n_echoes;
+        out->n_timeouts = c->n_timeouts;
+        out->n_skipped = c->n_skipped;
+        out->n_filtered = c->n_filtered;
+        out->n_background = c->n_background;
+        out->readings_per_sec = per_second(n_readings, elapsed);
+        out->timeout_percent = n_readings ? c->n_timeouts * 100 / n_readings : 0;
+        memcpy(out->echo_histogram, c->echo_histogram, sizeof(c->echo_histogram));
+        out->interval_mean = c->n_intervals ? c->interval_sum / c->n_intervals : 0;
+        out->jitter_mean = c->n_intervals > 1 ? c->jitter_sum / (c->n_intervals - 1) : 0;
+        out->jitter_max = c->jitter_max;
+    }
+    irq_restore(cpsr);
+}
+
+void sonic_reset_stats(sonic_array_t *arr)
 {
-    return sonic_rb_dequeue(state.arr_readings, read_dest);
+    unsigned cpsr = irq_save();
+    memset(arr->counters, 0, sizeof(arr->counters));
+    arr->stats_reset_time = timer_get_ticks();
+    arr->stats_base_published = arr->n_published;
+    arr->stats_base_dropped = arr->dropped_cycles;
+    arr->stats_base_overruns = arr->latest_overruns;
+    arr->stats_base_pool_overruns = arr->pool_overruns;
+    arr->isr_count = 0;
+    arr->isr_time_sum = 0;
+    arr->isr_time_max = 0;
+    irq_restore(cpsr);
 }
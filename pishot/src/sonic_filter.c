@@ -0,0 +1,84 @@
+#include "sonic_filter.h"
+#include "strings.h"
+#include "utils.h"
+
+// ---------------- BEGIN SPIKE FILTER ----------------
+// Sorts the `n` elements of `a` in place; `n` is at most the filter window,
+// so insertion sort is the fastest option
+static void sort_small(int a[], int n)
+{
+    for (int i = 1; i < n; i++) {
+        int x = a[i], j = i;
+        for (; j > 0 && a[j - 1] > x; j--) a[j] = a[j - 1];
+        a[j] = x;
+    }
+}
+
+// This is a causal Hampel filter: a sample is a spike if it is further from
+// the median of the last `window_size` samples than `threshold` times their
+// median absolute deviation (scaled by 1.5 to estimate a standard deviation).
+// The raw sample is always kept, so a genuine jump in distance is adopted as
+// soon as it makes up half the window. Costs a bounded number of steps per sample.
+int sonic_filter_sample(sonic_filter_t *filter, int window_size, unsigned threshold, int distance)
+{
+    filter->samples[filter->next] = distance;
+    filter->next = (filter->next + 1) % window_size;
+    if (filter->n < window_size) filter->n++;
+    // Too little history yet to call anything a spike
+    if (filter->n < window_size) return distance;
+
+    int sorted[SONIC_FILTER_MAX_WINDOW];
+    memcpy(sorted, filter->samples, sizeof(int) * filter->n);
+    sort_small(sorted, filter->n);
+    int median = sorted[filter->n / 2];
+    for (int i = 0; i < filter->n; i++) {
+        sorted[i] = abs(sorted[i] - median);
+    }
+    sort_small(sorted, filter->n);
+    int mad = sorted[filter->n / 2];
+    int limit = max((int)threshold * mad * 3 / 2, SONIC_FILTER_MIN_DEVIATION);
+    return abs(distance - median) > limit ? median : distance;
+}
+// ---------------- END SPIKE FILTER ----------------
+
+// ---------------- BEGIN BACKGROUND MODEL ----------------
+#define BACKGROUND_SMOOTHING 8 // Each matching reading moves the background 1/8 of the way
+
+static bool matches_background(int a, int b)
+{
+    if (a == SONIC_INVALID_READING || b == SONIC_INVALID_READING) return a == b;
+    return abs(a - b) <= SONIC_BACKGROUND_MARGIN;
+}
+
+void sonic_background_seed(sonic_background_t *bg, int distance, unsigned now)
+{
+    *bg = (sonic_background_t) { .distance = distance, .candidate = distance, .candidate_since = now };
+}
+
+// A reading matching the background refines it; a different one that has held
+// still for `SONIC_BACKGROUND_SETTLE` replaces it. A ball in flight never holds still.
+bool sonic_background_learn(sonic_background_t *bg, unsigned entry_range, int distance, unsigned timestamp)
+{
+    // Nothing beyond the entry range matters
+    if (entry_range && distance > (int)entry_range) distance = SONIC_INVALID_READING;
+    if (!matches_background(distance, bg->candidate)) {
+        bg->candidate = distance;
+        bg->candidate_since = timestamp;
+    }
+    if (matches_background(distance, bg->distance)) {
+        if (distance == SONIC_INVALID_READING) return false;
+        bg->distance += (distance - bg->distance) / BACKGROUND_SMOOTHING;
+    } else if (timestamp - bg->candidate_since >= SONIC_BACKGROUND_SETTLE) {
+        bg->distance = bg->candidate;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool sonic_background_hides(const sonic_background_t *bg, int distance)
+{
+    if (bg->distance == SONIC_INVALID_READING || distance == SONIC_INVALID_READING) return false;
+    return distance > bg->distance - SONIC_BACKGROUND_MARGIN;
+}
+// ---------------- END BACKGROUND MODEL ----------------
@@ -0,0 +1,80 @@
+/* File: sonic_log.c
+ * ------------------
+ * Lock-free ring buffer of raw sonic events that allows for
+ * concurrent access by 1 reader and 1 writer.
+ *
+ * Adapted from `sonic_rb.c`.
+ */
+
+#include "sonic_log.h"
+#include "malloc.h"
+
+#define LENGTH 256
+
+/*
+ * Same layout as `sonic_rb`: head is the index of the frontmost event,
+ * tail is the index of the next position to use, and one slot remains
+ * permanently empty to distinguish full from empty.
+ */
+struct sonic_log {
+    sonic_event_t entries[LENGTH];
+    unsigned int head, tail;
+};
+
+
+sonic_log_t *sonic_log_new(void)
+{
+    sonic_log_t *log = malloc(sizeof(struct sonic_log));
+    if (log == NULL) return NULL;
+    log->head = log->tail = 0;
+    return log;
+}
+
+bool sonic_log_empty(sonic_log_t *log)
+{
+    return log->head == log->tail;
+}
+
+unsigned sonic_log_space(sonic_log_t *log)
+{
+    return (log->head + LENGTH - log->tail - 1) % LENGTH;
+}
+
+/*
+ * Note: enqueue is called by writer and only advances log->tail.
+ */
+bool sonic_log_enqueue(sonic_log_t *log, sonic_event_t event)
+{
+    if ((log->tail + 1) % LENGTH == log->head) return false;
+
+    log->entries[log->tail] = event;
+    log->tail = (log->tail + 1) % LENGTH;
+    return true;
+}
+
+/*
+ * Note: called by writer, but advances log->head (see sonic_log.h).
+ */
+bool sonic_log_drop_cycle(sonic_log_t *log)
+{
+    unsigned int end = log->head;
+    while (end != log->tail && log->entries[end].kind != SONIC_EVENT_CYCLE_END) {
+        end = (end + 1) % LENGTH;
+    }
+    if (end == log->tail) return false;
+
+    log->head = (end + 1) % LENGTH;
+    return true;
+}
+
+/*
+ * Note: dequeue is called by reader and only advances log->head.
+ */
+bool sonic_log_dequeue(sonic_log_t *log, sonic_event_t *p_event)
+{
+    if (sonic_log_empty(log)) return false;
+
+    *p_event = log->entries[log->head];
+    log->head = (log->head + 1) % LENGTH;
+    return true;
+}
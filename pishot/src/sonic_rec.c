@@ -0,0 +1,45 @@
+/* File: sonic_rec.c
+ * ------------------
+ * Delta-encoded binary stream of sonic frames over the UART.
+ */
+
+#include "sonic_rec.h"
+#include "strings.h"
+#include "uart.h"
+
+// Writes `value` as a zigzag varint, adding every byte sent to `*checksum`
+static void put_varint(int value, unsigned char *checksum)
+{
+    unsigned zigzag = ((unsigned)value << 1) ^ (unsigned)(value >> 31);
+    while (zigzag >= 0x80) {
+        unsigned char byte = (zigzag & 0x7f) | 0x80;
+        uart_putchar(byte);
+        *checksum += byte;
+        zigzag >>= 7;
+    }
+    uart_putchar(zigzag);
+    *checksum += zigzag;
+}
+
+void sonic_rec_start(sonic_rec_t *rec, int n_sensors)
+{
+    rec->n_sensors = n_sensors;
+    memset(rec->prev, 0, sizeof(rec->prev));
+    for (const char *c = SONIC_REC_MAGIC; *c; c++) {
+        uart_putchar(*c);
+    }
+    uart_putchar(n_sensors);
+}
+
+void sonic_rec_frame(sonic_rec_t *rec, const sonic_data_t frame[])
+{
+    unsigned char checksum = SONIC_REC_FRAME;
+    uart_putchar(SONIC_REC_FRAME);
+    for (int i = 0; i < rec->n_sensors; i++) {
+        put_varint(frame[i].distance - rec->prev[i].distance, &checksum);
+        // Timer wraps around; unsigned subtraction keeps the change small across it
+        put_varint((int)((unsigned)frame[i].timestamp - (unsigned)rec->prev[i].timestamp), &checksum);
+        rec->prev[i] = frame[i];
+    }
+    uart_putchar(checksum);
+}
@@ -11,55 +11,205 @@
 
 #define N_SENSORS 4
 
+static sonic_array_t *sonic;
+
+static void print_stats(void)
+{
+    sonic_stats_t stats;
+    sonic_get_stats(sonic, &stats);
+    printf("%d frames in %d microsecs (%d per sec). Dropped cycles: %d. Pool overruns: %d. Latest overruns: %d.\n",
+        stats.n_frames, stats.elapsed, stats.frames_per_sec, stats.dropped_cycles,
+        stats.pool_overruns, stats.latest_overruns);
+    printf("%d interrupts, mean %d microsecs, max %d microsecs.\n",
+        stats.isr_count, stats.isr_time_mean, stats.isr_time_max);
+    for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+        sonic_sensor_stats_t *s = &stats.sensors[sensor];
+        printf("Sensor %d: fired %d, echoes %d (%d filtered, %d background), timeouts %d (%d%%), skipped %d, %d readings per sec.\n",
+            sensor, s->n_fired, s->n_echoes, s->n_filtered, s->n_background, s->n_timeouts, s->timeout_percent, s->n_skipped, s->readings_per_sec);
+        printf("    Interval mean %d, jitter mean %d, max %d microsecs. Echo histogram:",
+            s->interval_mean, s->jitter_mean, s->jitter_max);
+        for (int b = 0; b < SONIC_STATS_BUCKETS; b++) {
+            printf(" %d", s->echo_histogram[b]);
+        }
+        printf("\n");
+    }
+}
+
 #define N_READINGS_LONG 10000
 #define N_READINGS_SHORT 5
 #define ASYNC_DELAY_SENSOR 1000
 #define ASYNC_DELAY_ARRAY 1000000
 void test_async(void)
 {
-    sonic_set_unit_delay(ASYNC_DELAY_SENSOR);
-    sonic_set_cycle_delay(ASYNC_DELAY_ARRAY);
+    sonic_set_unit_delay(sonic, ASYNC_DELAY_SENSOR);
+    sonic_set_cycle_delay(sonic, ASYNC_DELAY_ARRAY);
 
     printf("Testing %d-sensor array for %d cycles.\n", N_SENSORS, N_READINGS_LONG);
-    assert(!sonic_is_active());
-    sonic_on();
-    assert(sonic_is_active());
+    sonic_reset_stats(sonic);
+    assert(!sonic_set_filter(sonic, SONIC_FILTER_MAX_WINDOW + 1, 3));
+    assert(sonic_set_filter(sonic, 5, 3));
+    assert(!sonic_is_active(sonic));
+    sonic_on(sonic);
+    assert(sonic_is_active(sonic));
     sonic_data_t *result;
     int i = 0;
     while (i < N_READINGS_LONG) {
-        if (sonic_read_async(&result)) {
+        if (sonic_read_async(sonic, &result)) {
             for (int sensor = 0; sensor < N_SENSORS; sensor++) {
                 printf("[Reading %d] Sensor %d: Distance = %d mm. Timestamp = %d microsecs.\n",
                 i, sensor, result[sensor].distance, (int)result[sensor].timestamp);
                 
             }
             printf("\n");
-            free(result);
+            sonic_release(sonic, result);
             i++;
         }
     }
-    sonic_off();
-    assert(!sonic_is_active());
+    sonic_off(sonic);
+    assert(!sonic_is_active(sonic));
+    print_stats();
 
+    for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+        sonic_health_t health;
+        assert(sonic_get_health(sonic, sensor, &health));
+        printf("Sensor %d is %s (%d consecutive timeouts).\n",
+            sensor, health.is_alive ? "alive" : "dead", health.timeout_streak);
+    }
     printf("Finished testing %d-sensor array.\n", N_SENSORS);
     timer_delay(2);
     printf("Testing restart of sonic module for %d cycles.\n", N_READINGS_SHORT);
-    sonic_on();
+    sonic_on(sonic);
     i = 0;
     while (i < N_READINGS_SHORT) {
-        if (sonic_read_async(&result)) {
+        if (sonic_read_async(sonic, &result)) {
             for (int sensor = 0; sensor < N_SENSORS; sensor++) {
                 printf("[Reading %d] Sensor %d: Distance = %d mm. Timestamp = %d microsecs.\n",
                 i, sensor, result[sensor].distance, (int)result[sensor].timestamp);
                 
             }
             printf("\n");
-            free(result);
+            sonic_release(sonic, result);
+            i++;
+        }
+    }
+    sonic_off(sonic);
+    sonic_set_filter(sonic, 0, 0);
+    sonic_deinit(sonic);
+}
+
+#define LATEST_ITER_DELAY 250000
+// Oldest a snapshot may be after a stall: a few cycles, far less than the stall itself
+#define LATEST_MAX_AGE 100000
+void test_latest(void)
+{
+    sonic_set_unit_delay(sonic, ASYNC_DELAY_SENSOR);
+    sonic_set_cycle_delay(sonic, 0);
+
+    printf("Testing latest-frame snapshot for %d reads.\n", N_READINGS_SHORT);
+    sonic_data_t result[N_SENSORS];
+    sonic_on(sonic);
+    int i = 0;
+    while (i < N_READINGS_SHORT) {
+        // Deliberately fall behind the read loop; every read should still be current
+        timer_delay_us(LATEST_ITER_DELAY);
+        if (sonic_read_latest(sonic, result)) {
+            for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+                printf("[Reading %d] Sensor %d: Distance = %d mm. Timestamp = %d microsecs.\n",
+                i, sensor, result[sensor].distance, (int)result[sensor].timestamp);
+            }
+            printf("Frames skipped so far: %d. Now: %d microsecs.\n\n",
+                sonic_latest_overruns(sonic), timer_get_ticks());
+            assert(timer_get_ticks() - (unsigned)result[0].timestamp < LATEST_MAX_AGE);
             i++;
         }
     }
-    sonic_off();
-    sonic_deinit();
+    sonic_off(sonic);
+    assert(sonic_latest_overruns(sonic) > 0);
+}
+
+void test_calibrate(void)
+{
+    printf("Calibrating guard times; keep the area in front of the sensors clear.\n");
+    unsigned start = timer_get_ticks();
+    int background;
+    assert(sonic_calibrate(sonic));
+    printf("Calibration took %d microsecs.\n", timer_get_ticks() - start);
+    for (int from = 0; from < N_SENSORS; from++) {
+        for (int to = 0; to < N_SENSORS; to++) {
+            unsigned guard;
+            assert(sonic_get_guard(sonic, from, to, &guard));
+            printf("Sensor %d -> sensor %d: %d microsecs.\n", from, to, guard);
+        }
+    }
+    // Calibration readings seed the background; the rate controller test below keeps learning it
+    assert(!sonic_get_background(sonic, 0, &background));
+    sonic_set_background(sonic, true);
+    for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+        assert(sonic_get_background(sonic, sensor, &background));
+        printf("Sensor %d background: %d mm.\n", sensor, background);
+    }
+    sonic_set_cycle_delay(sonic, 0);
+
+    printf("Reading %d cycles with calibrated guard times.\n", N_READINGS_SHORT);
+    sonic_on(sonic);
+    sonic_data_t *result;
+    int i = 0;
+    unsigned first = 0;
+    while (i < N_READINGS_SHORT) {
+        if (sonic_read_async(sonic, &result)) {
+            if (i == 0) first = timer_get_ticks();
+            sonic_release(sonic, result);
+            i++;
+        }
+    }
+    sonic_off(sonic);
+    printf("Average cycle: %d microsecs.\n", (timer_get_ticks() - first) / (N_READINGS_SHORT - 1));
+    // Back to hand-set delays for the remaining tests
+    sonic_set_unit_delay(sonic, ASYNC_DELAY_SENSOR);
+    assert(!sonic_get_guard(sonic, 0, 0, &start));
+}
+
+#define IDLE_DELAY_ARRAY 200000
+#define ENTRY_RANGE 500 // in mm
+#define N_MODE_CHANGES 6
+void test_tracking(void)
+{
+    // Idle scan fires sensor 0 alone; wave a hand in front of it to start tracking
+    const unsigned idle_groups[] = { SONIC_SENSOR_BIT(0) };
+    assert(sonic_set_idle_scan(sonic, idle_groups, 1, IDLE_DELAY_ARRAY, ENTRY_RANGE));
+    sonic_set_unit_delay(sonic, ASYNC_DELAY_SENSOR);
+    sonic_set_cycle_delay(sonic, 0);
+
+    printf("Testing rate controller for %d mode changes.\n", N_MODE_CHANGES);
+    sonic_on(sonic);
+    assert(!sonic_is_tracking(sonic));
+    bool tracking = false;
+    int n_frames = 0, changes = 0;
+    unsigned since = timer_get_ticks();
+    sonic_data_t *result;
+    while (changes < N_MODE_CHANGES) {
+        if (sonic_read_async(sonic, &result)) {
+            n_frames++;
+            sonic_release(sonic, result);
+        }
+        if (sonic_is_tracking(sonic) != tracking) {
+            printf("%s after %d frames in %d microsecs.\n", tracking ? "Lost target" : "Tracking",
+                n_frames, timer_get_ticks() - since);
+            tracking = !tracking;
+            n_frames = 0;
+            since = timer_get_ticks();
+            changes++;
+        }
+    }
+    sonic_off(sonic);
+    for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+        int background;
+        assert(sonic_get_background(sonic, sensor, &background));
+        printf("Sensor %d background: %d mm.\n", sensor, background);
+    }
+    sonic_set_background(sonic, false);
+    assert(sonic_set_idle_scan(sonic, NULL, 0, 0, 0));
+    assert(sonic_is_tracking(sonic));
 }
 
 #define SYNC_DELAY_SENSOR 10
@@ -67,28 +217,74 @@ void test_async(void)
 #define ITER_DELAY 500000
 #define N_ITERS 10000
 #define N_READINGS_PER_ITER 2
-#define N_TIMEOUTS 4
+#define N_MIN_VALID 3
+#define SYNC_RETRY_AGE 50000
+// Longest a single attempt can take with the default one-sensor-per-group schedule
+#define SYNC_MAX_ATTEMPT (N_SENSORS * (SONIC_DEFAULT_TIMEOUT + 1000))
+
+// A retry may keep readings up to the retry age old at the start of the final
+// attempt, so no valid reading may trail the frame's newest by more than that
+// plus the attempt itself
+static void check_sync_frame(const sonic_data_t *result)
+{
+    int n_valid = 0;
+    unsigned newest = 0;
+    for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+        if (result[sensor].distance == SONIC_INVALID_READING) continue;
+        if (n_valid++ == 0 || (int)(result[sensor].timestamp - newest) > 0) newest = result[sensor].timestamp;
+    }
+    assert(n_valid >= N_MIN_VALID);
+    for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+        if (result[sensor].distance == SONIC_INVALID_READING) continue;
+        assert(newest - (unsigned)result[sensor].timestamp < SYNC_RETRY_AGE + SYNC_MAX_ATTEMPT);
+    }
+}
+
 void test_sync(void)
 {
-    sonic_set_unit_delay(SYNC_DELAY_SENSOR);
-    sonic_set_cycle_delay(SYNC_DELAY_ARRAY);
-    printf("Testing %d-sensor array for %d cycles, with max %d timeout(s) per array.\n",
-        N_SENSORS, N_READINGS_PER_ITER * N_ITERS, N_TIMEOUTS);
-    sonic_data_t *result;
+    sonic_set_unit_delay(sonic, SYNC_DELAY_SENSOR);
+    sonic_set_cycle_delay(sonic, SYNC_DELAY_ARRAY);
+    sonic_set_retry_age(sonic, SYNC_RETRY_AGE);
+    printf("Testing %d-sensor array for %d cycles, with min %d valid reading(s) per array.\n",
+        N_SENSORS, N_READINGS_PER_ITER * N_ITERS, N_MIN_VALID);
+    sonic_data_t *results[N_READINGS_PER_ITER];
     for (int i = 0; i < N_ITERS; i++) {
-        sonic_read_sync(&result, N_READINGS_PER_ITER, N_TIMEOUTS);
+        sonic_read_sync_multiple(sonic, results, N_READINGS_PER_ITER, N_MIN_VALID);
         for (int reading = 0; reading < N_READINGS_PER_ITER; reading++) {
+            sonic_data_t *result = results[reading];
+            printf("[Reading %d] Valid sensors: 0x%x.\n", i * N_READINGS_PER_ITER + reading,
+                sonic_valid_mask(sonic, result));
+            check_sync_frame(result);
             for (int sensor = 0; sensor < N_SENSORS; sensor++) {
                 printf("[Reading %d] Sensor %d: Distance = %d mm. Timestamp = %d microsecs.\n",
                     i * N_READINGS_PER_ITER + reading, sensor, result[sensor].distance, (int)result[sensor].timestamp);
             }
             printf("\n");
+            free(result);
         }
-        free(result);
         timer_delay_us(ITER_DELAY);
     }
 }
 
+#define N_BURST_FRAMES 7
+void test_burst(void)
+{
+    sonic_set_unit_delay(sonic, SYNC_DELAY_SENSOR);
+    sonic_set_cycle_delay(sonic, 0);
+    printf("Testing %d-frame burst read into caller buffers.\n", N_BURST_FRAMES);
+    int distances[N_BURST_FRAMES][N_SENSORS];
+    unsigned timestamps[N_BURST_FRAMES][N_SENSORS];
+    unsigned start = timer_get_ticks();
+    assert(sonic_read_burst(sonic, &distances[0][0], &timestamps[0][0], N_BURST_FRAMES, N_MIN_VALID));
+    printf("Burst took %d microsecs.\n", timer_get_ticks() - start);
+    for (int f = 0; f < N_BURST_FRAMES; f++) {
+        for (int sensor = 0; sensor < N_SENSORS; sensor++) {
+            printf("[Frame %d] Sensor %d: Distance = %d mm. Timestamp = %d microsecs.\n",
+                f, sensor, distances[f][sensor], timestamps[f][sensor]);
+        }
+        printf("\n");
+    }
+}
 
 typedef struct {
      struct gpio_motor {
@@ -131,13 +327,28 @@ void main(void)
     uart_init();
     countdown_init(COUNTDOWN_MODE_CONTINUOUS, NULL);
     gpio_layout_t layout = get_pin_layout();
-    sonic_init(layout.sensors, N_SENSORS);
+    sonic = sonic_init(layout.sensors, N_SENSORS);
+    assert(sonic != NULL);
 
     interrupts_global_enable(); // everything fully initialized, now turn on interrupts
 
     printf("Testing synchronous mode.\n");
     test_sync();
     timer_delay(2);
+    test_burst();
+    timer_delay(2);
+
+    printf("Testing latest-frame snapshot.\n");
+    test_latest();
+    timer_delay(2);
+
+    printf("Testing guard time calibration.\n");
+    test_calibrate();
+    timer_delay(2);
+
+    printf("Testing rate controller.\n");
+    test_tracking();
+    timer_delay(2);
 
     printf("Testing asynchronous mode.\n");
     test_async();